@@ -5,16 +5,48 @@
 const char *build_bin = "build";
 const char *build_source = "build.c";
 
+// build.h hashmap layouts tests/hashmap.c is compiled and run for
+const char *hashmap_variants[][2] = {
+	{ "default", "" },
+	{ "swiss", "-DHM_SWISS" },
+	{ "incremental", "-DHM_INCREMENTAL" },
+	{ "swiss_incremental", "-DHM_SWISS -DHM_INCREMENTAL" },
+	{ "robin_hood", "-DHM_ROBIN_HOOD" },
+	{ "robin_hood_incremental", "-DHM_ROBIN_HOOD -DHM_INCREMENTAL" },
+	{ "avx2", "-DHM_SWISS -mavx2" },
+};
+
+void run_tests(void)
+{
+	for (size_t i = 0; i < sizeof(hashmap_variants) / sizeof(hashmap_variants[0]); ++i)
+	{
+		// vector code this machine cannot run is left for one that can
+		if (strstr(hashmap_variants[i][1], "-mavx2") && !__builtin_cpu_supports("avx2")) {
+			WARN("skipping the %s layout, no AVX2 here.", hashmap_variants[i][0]);
+			continue;
+		}
+
+		const char *bin = formate_string("bin/test_hashmap_%s", hashmap_variants[i][0]);
+		if (!execute(formate_string("cc -o %s tests/hashmap.c -Wall -Wextra -O1 %s", bin, hashmap_variants[i][1])) || !execute(formate_string("./%s", bin)))
+			ERROR("hashmap test failed for the %s layout.", hashmap_variants[i][0]), exit(1);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	create_directory("bin/");
 
+	if (argc > 1 && !strcmp(argv[1], "test")) {
+		run_tests();
+		return 0;
+	}
+
 	const char **files = get_files("src/");
 	if (is_binary_old("bin/main", files))
 	{
 		const char **source_files_array = get_files_with_specific_ext("src/", ".c");
 		const char *source_files = string_list_to_const_string(source_files_array, darray_len(source_files_array), ' ');
-		if (!execute(formate_string("cc -o %s %s -Isrc/ -Wall -Wextra -O3", "bin/main", source_files)))
+		if (!execute(formate_string("cc -o %s %s -Isrc/ -Wall -Wextra -O3 -pthread", "bin/main", source_files)))
 			ERROR("failed to compile."), exit(1);
 	}
 
@@ -49,6 +49,8 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 // called at the end of scope
 #define defer(func) __attribute__((cleanup(func)))
@@ -57,109 +59,562 @@
 #define formate_string(...) ({ __formate_string_function__(__VA_ARGS__, NULL); })
 
 // log-system
-#define INFO(...) printf("%s[BUILD :: INFO]:%s %s\n", get_term_color(TEXT, GREEN), get_term_color(RESET, 0), formate_string(__VA_ARGS__))
-#define WARN(...) printf("%s[BUILD :: WARN]:%s %s\n", get_term_color(TEXT, YELLOW), get_term_color(RESET, 0), formate_string(__VA_ARGS__))
-#define ERROR(...) printf("%s[BUILD :: ERROR]:%s %s\n", get_term_color(TEXT, RED), get_term_color(RESET, 0), formate_string(__VA_ARGS__))
+// each call gives its message back to the arena on the way out, so logging in a
+// loop does not grow it; still an expression, `ERROR(...), exit(1)` works
+#define INFO(...) ({ arena_scope(); printf("%s[BUILD :: INFO]:%s %s\n", get_term_color(TEXT, GREEN), get_term_color(RESET, 0), formate_string(__VA_ARGS__)); })
+#define WARN(...) ({ arena_scope(); printf("%s[BUILD :: WARN]:%s %s\n", get_term_color(TEXT, YELLOW), get_term_color(RESET, 0), formate_string(__VA_ARGS__)); })
+#define ERROR(...) ({ arena_scope(); printf("%s[BUILD :: ERROR]:%s %s\n", get_term_color(TEXT, RED), get_term_color(RESET, 0), formate_string(__VA_ARGS__)); })
 
 #define LOAD_FACTOR 0.875
 #define POWER_FACTOR 2
 
+// define HM_ROBIN_HOOD before including for linear probing that keeps every
+// probe run ordered by distance from home, a lookup stops at the first bucket
+// closer to its home than the key would be and deletes shift the run back
+#if defined(HM_ROBIN_HOOD) && defined(HM_SWISS)
+#error "HM_ROBIN_HOOD and HM_SWISS are separate bucket layouts, define one of them"
+#endif
+
+// define HM_INCREMENTAL before including to spread each rehash over the
+// operations that follow it instead of stopping hm_put for all of it; every
+// operation then writes to the map, lookups included (see hm_geti)
+#define HM_MIGRATE_STEP 16
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// define HM_SWISS before including for hashmaps that keep one control byte
+// per bucket and probe a whole group of them with a single vector compare,
+// keys are only compared where the 7 bit hash fragment matches
+#ifdef HM_SWISS
+#define HM_EMPTY 0x80
+#define HM_DELETED 0xfe
+#if defined(__AVX2__)
+#define HM_GROUP 32
+#elif defined(__SSE2__)
+#define HM_GROUP 16
+#else
+#define HM_GROUP 8
+#endif
+#endif
+
+// define HM_STATS before including to keep per-map probe length histograms
+// and rehash telemetry in hm_stats_t, read with hm_stats(map) or map.stats
+#define HM_PROBE_HIST 16
+
+typedef struct {
+	size_t get_probes[HM_PROBE_HIST]; // lookups by buckets (groups with HM_SWISS) probed past the home one, the last entry also counts longer probes
+	size_t put_probes[HM_PROBE_HIST]; // inserts and updates, likewise
+	size_t resizes;                   // rehashes into a new bucket table
+	double rehash_time;               // seconds spent in them, incremental migration included
+	size_t probe;                     // length of the last probe
+} hm_stats_t;
+
+#ifdef HM_STATS
+#define __HM_STATS_FIELD__ hm_stats_t stats;
+#define __hm_stats_probe__(stats, len) ((stats)->probe += (len))
+#define __hm_stats_record__(stats, hist, len) ((stats)->hist[(len) < HM_PROBE_HIST - 1 ? (len) : HM_PROBE_HIST - 1]++)
+#define __hm_stats_count__(stats, hist) __hm_stats_record__(stats, hist, (stats)->probe)
+#define __hm_stats_start__() double __hm_start__ = __hm_stats_now__()
+#define __hm_stats_stop__(stats) ((stats)->resizes++, (stats)->rehash_time += __hm_stats_now__() - __hm_start__)
+#define __hm_stats_time__(stats) ((stats)->rehash_time += __hm_stats_now__() - __hm_start__)
+#else
+#define __HM_STATS_FIELD__
+#define __hm_stats_probe__(stats, len) ((void)0)
+#define __hm_stats_record__(stats, hist, len) ((void)0)
+#define __hm_stats_count__(stats, hist) ((void)0)
+#define __hm_stats_start__() do {} while(0)
+#define __hm_stats_stop__(stats) ((void)0)
+#define __hm_stats_time__(stats) ((void)0)
+#endif
+
+static inline double __hm_stats_now__(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (double)tp.tv_sec + (double)tp.tv_nsec * 1e-9;
+}
+
 #define SWAP(TYPE, A, B) do {\
 	TYPE T = A; \
 	A = B; \
 	B = T; \
 } while(0)
 
+#ifdef HM_STATS
+#define hm_stats(map) (&((hashmap_t*)__hashmap_get_meta__(map))->stats)
+#endif
+
+// offset of the key inside a KV entry
+#define hm_key_offset(map) ((size_t)((char*)&(map)->key - (char*)(map)))
+
 #define hm_put(map, KV) do {\
 	hashmap_t *hm = __hashmap_get_meta__(map); \
-	if (((float)hm->index / (float)hm->count) >= LOAD_FACTOR) { \
-		hm->count *= POWER_FACTOR; \
-		struct bucket *buckets = malloc(sizeof(struct bucket) * hm->count); \
-		memset(buckets, 0, sizeof(struct bucket) * hm->count); \
-		for (size_t i = 0; i < hm->count / POWER_FACTOR; ++i) {  \
-			struct bucket bkt = hm->buckets[i]; \
-			if (!bkt.filled) continue; \
-			uint64_t index = hm->hf(&map[bkt.index].key, bkt.size, hm->seed) % hm->count; \
-			uint64_t c = 0; \
-			while (c < hm->count) { \
-				index = (index + c * c) & (hm->count - 1); \
-				if (!buckets[index].filled) { \
-					buckets[index].size = bkt.size; \
-					buckets[index].index = bkt.index; \
-					buckets[index].filled = 1; \
-					break; \
-				} \
-				c++; \
-			} \
-		} \
-		map = __hashmap_get_meta__(map); \
-		map = realloc(map, sizeof(hashmap_t) + hm->count * hm->item_size); \
-		hm = (hashmap_t*)map; \
-		hm->buckets = realloc(hm->buckets, sizeof(struct bucket) * hm->count); \
-		memcpy(hm->buckets, buckets, sizeof(struct bucket) * hm->count); \
-		map = __hashmap_get_map__(map); \
-		free(buckets); \
+	typeof(KV) __kv = KV; \
+	if (((float)(hm->index + hm->tombstones) / (float)hm->count) >= LOAD_FACTOR) { \
+		/* mostly tombstones: rebuild in place instead of growing */ \
+		size_t __count = 2 * hm->tombstones >= hm->index ? hm->count : hm->count * POWER_FACTOR; \
+		map = __hm_grow__(map, __count, sizeof(__kv.key), hm_key_offset(map)); \
+		hm = __hashmap_get_meta__(map); \
 	} \
-	uint64_t index = hm->hf(&KV.key, sizeof(KV.key), hm->seed) % hm->count; \
-	uint64_t c = 0; \
-	while (c < hm->count) { \
-		index = (index + c * c) & (hm->count - 1); \
-		if ( \
-				sizeof(KV.key) == hm->buckets[index].size && \
-				hm->hc(&KV.key, &map[hm->buckets[index].index].key, sizeof(KV.key)) \
-		) { \
-			map[hm->buckets[index].index] = KV; \
-			break; \
-		} \
-		if (!hm->buckets[index].filled) { \
-			hm->buckets[index].size = sizeof(KV.key); \
-			hm->buckets[index].index = hm->index; \
-			hm->buckets[index].filled = 1; \
-			map[hm->index++] = KV; \
-			break; \
-		} \
-		c++; \
+	__hm_step__(map); \
+	uint64_t __hash = hm->hf(&__kv.key, sizeof(__kv.key), hm->seed); \
+	bool __found; \
+	size_t __slot = __hm_probe__(map, __hash, &__kv.key, sizeof(__kv.key), hm_key_offset(map), &__found); \
+	__hm_stats_count__(hm_stats(map), put_probes); \
+	if (__found) map[hm->buckets[__slot].index] = __kv; \
+	else { \
+		__hm_claim__(hm, __slot, __hash, sizeof(__kv.key), hm->index); \
+		map[hm->index++] = __kv; \
 	} \
 } while(0)
 
 #define hm_get(map, KV) { \
-	hashmap_t *hm = __hashmap_get_meta__(map); \
-	uint64_t index = hm->hf(&KV->key, sizeof(KV->key), hm->seed) % hm->count; \
-	uint64_t c = 0; \
-	while (c < hm->count) \
-	{\
-		index = (index + c * c) & (hm->count - 1); \
-		if (sizeof(KV->key) == hm->buckets[index].size && hm->hc(&KV->key, &map[hm->buckets[index].index].key, sizeof(KV->key))) {\
-			KV->value = map[hm->buckets[index].index].value; \
-			break; \
-		}\
-		c++; \
-	}\
+	long int __place = hm_geti(map, (*(KV))); \
+	if (__place >= 0) (KV)->value = map[__place].value; \
 }
 
+// remove the entry with KV's key; the last entry moves into its place in the
+// dense array, so indices from hm_geti are only valid until the next hm_del
+#define hm_del(map, KV) do { \
+	hashmap_t *hm = __hashmap_get_meta__(map); \
+	typeof(KV) __kv = KV; \
+	__hm_step__(map); \
+	bool __found; \
+	size_t __slot = __hm_probe__(map, hm->hf(&__kv.key, sizeof(__kv.key), hm->seed), &__kv.key, sizeof(__kv.key), hm_key_offset(map), &__found); \
+	if (__found) __hm_remove__(map, __slot, sizeof(__kv.key), hm_key_offset(map)); \
+} while(0)
+
+// drop tombstones and shrink the buckets and dense array to fit the live entries
+#define hm_compact(map) do { \
+	hashmap_t *hm = __hashmap_get_meta__(map); \
+	size_t __count = 1; \
+	while (__count < hm->initial_size || (float)hm->index / (float)__count >= LOAD_FACTOR / 2) __count *= 2; \
+	map = __hm_rehash__(map, __count, sizeof((map)->key), hm_key_offset(map)); \
+} while(0)
+
+// size the map for `n` entries up front, no hm_put grows it before that
+#define hm_reserve(map, n) do { \
+	hashmap_t *hm = __hashmap_get_meta__(map); \
+	size_t __count = hm->count; \
+	while ((float)(n) / (float)__count >= LOAD_FACTOR) __count *= POWER_FACTOR; \
+	if (__count != hm->count) map = __hm_rehash__(map, __count, sizeof((map)->key), hm_key_offset(map)); \
+} while(0)
+
+// index of KV's key in the dense array, -1 if absent. With HM_INCREMENTAL a
+// lookup also migrates buckets of a running rehash, so it writes to the map:
+// threads that only read a map still have to lock it to share it
 #define hm_geti(map, KV) ({ \
 	hashmap_t *hm = __hashmap_get_meta__(map); \
-	uint64_t index = hm->hf(&KV.key, sizeof(KV.key), hm->seed) % hm->count; \
-	uint64_t c = 0; \
-	while (c < hm->count) \
-	{\
-		index = (index + c * c) & (hm->count - 1); \
-		if (sizeof(KV.key) == hm->buckets[index].size && hm->hc(&KV.key, &map[hm->buckets[index].index].key, sizeof(KV.key))) {\
-			break; \
-		}\
-		c++; \
-	}\
-	(c >= hm->count ? -1 : (long int)hm->buckets[index].index); \
+	typeof(KV) __kv = KV; \
+	__hm_step__(map); \
+	bool __found; \
+	size_t __slot = __hm_probe__(map, hm->hf(&__kv.key, sizeof(__kv.key), hm->seed), &__kv.key, sizeof(__kv.key), hm_key_offset(map), &__found); \
+	__hm_stats_count__(hm_stats(map), get_probes); \
+	(__found ? (long int)hm->buckets[__slot].index : -1); \
 })
 
+// keys hashed and prefetched together by the _batch functions of DEFINE_HASHMAP
+#define HM_BATCH 16
+
+// murmur3's 64 bit finalizer, every input bit reaches every output bit
+static inline uint64_t hm_mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51af45ff4a7c15;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+	return h;
+}
+
+// neither SSE2 nor AVX2 multiplies 64 bit lanes, the low half of the product
+// is put together from three 32x32 bit ones instead
+#if defined(__AVX2__)
+static inline __m256i __hm_mul64__(__m256i a, __m256i b)
+{
+	__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+	return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+}
+
+static inline __m256i __hm_mix64_lanes__(__m256i h)
+{
+	h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+	h = __hm_mul64__(h, _mm256_set1_epi64x((long long)0xff51af45ff4a7c15));
+	h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+	h = __hm_mul64__(h, _mm256_set1_epi64x((long long)0xc4ceb9fe1a85ec53));
+	return _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+}
+#define HM_MIX_LANES 4
+#elif defined(__SSE2__)
+static inline __m128i __hm_mul64__(__m128i a, __m128i b)
+{
+	__m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b), _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+	return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+}
+
+static inline __m128i __hm_mix64_lanes__(__m128i h)
+{
+	h = _mm_xor_si128(h, _mm_srli_epi64(h, 33));
+	h = __hm_mul64__(h, _mm_set1_epi64x((long long)0xff51af45ff4a7c15));
+	h = _mm_xor_si128(h, _mm_srli_epi64(h, 33));
+	h = __hm_mul64__(h, _mm_set1_epi64x((long long)0xc4ceb9fe1a85ec53));
+	return _mm_xor_si128(h, _mm_srli_epi64(h, 33));
+}
+#define HM_MIX_LANES 2
+#endif
+
+// hm_mix64 over `n` values in place, HM_MIX_LANES at a time where there are vector units
+static inline void hm_mix64_batch(uint64_t *h, size_t n)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	for (; i + HM_MIX_LANES <= n; i += HM_MIX_LANES)
+		_mm256_storeu_si256((__m256i*)(h + i), __hm_mix64_lanes__(_mm256_loadu_si256((const __m256i*)(h + i))));
+#elif defined(__SSE2__)
+	for (; i + HM_MIX_LANES <= n; i += HM_MIX_LANES)
+		_mm_storeu_si128((__m128i*)(h + i), __hm_mix64_lanes__(_mm_loadu_si128((const __m128i*)(h + i))));
+#endif
+	for (; i < n; ++i) h[i] = hm_mix64(h[i]);
+}
+
+// DEFINE_HASHMAP(name, K, V, hash, eq) generates a typed open addressing map
+// name##_t with `uint64_t hash(K)` and `bool eq(K, K)` inlined into every
+// probe. Slots hold the key and value in place, a parallel control byte per
+// slot is 0 when empty and carries 7 bits of the hash otherwise so most
+// mismatches never touch the key. Linear probing at a load of 3/4, deletes
+// shift the run back so there are no tombstones. With HM_STATS the map keeps
+// its hm_stats_t in `stats`.
+#define DEFINE_HASHMAP(name, K, V, hash, eq) \
+/* one hash after the other, see DEFINE_HASHMAP_MIX64 for vector lanes */ \
+static inline void name##_hash_batch(const K *keys, size_t n, uint64_t *hashes) \
+{ \
+	for (size_t i = 0; i < n; ++i) hashes[i] = hash(keys[i]); \
+} \
+__DEFINE_HASHMAP__(name, K, V, hash, eq)
+
+// DEFINE_HASHMAP_MIX64(name, K, V, key64, eq) is DEFINE_HASHMAP hashing with
+// hm_mix64(key64(key)), name##_hash. Its _batch functions take the 64 bit
+// keys of a block first and mix them with hm_mix64_batch, which a loop over
+// an opaque hash never turns into, for want of a 64 bit vector multiply
+#define DEFINE_HASHMAP_MIX64(name, K, V, key64, eq) \
+static inline uint64_t name##_hash(K key) \
+{ \
+	return hm_mix64(key64(key)); \
+} \
+\
+static inline void name##_hash_batch(const K *keys, size_t n, uint64_t *hashes) \
+{ \
+	for (size_t i = 0; i < n; ++i) hashes[i] = key64(keys[i]); \
+	hm_mix64_batch(hashes, n); \
+} \
+__DEFINE_HASHMAP__(name, K, V, name##_hash, eq)
+
+#define __DEFINE_HASHMAP__(name, K, V, hash, eq) \
+typedef struct { \
+	K key; \
+	V value; \
+} name##_slot_t; \
+\
+typedef struct { \
+	name##_slot_t *slots; \
+	uint8_t *ctrl; \
+	size_t len; \
+	size_t mask; \
+	__HM_STATS_FIELD__ \
+} name##_t; \
+\
+static inline uint8_t name##_tag(uint64_t h) { return 0x80 | (uint8_t)(h >> 57); } \
+\
+static inline void name##_init(name##_t *map, size_t capacity) \
+{ \
+	size_t count = 16; \
+	while (count < capacity) count *= 2; \
+	*map = (name##_t) { 0 }; \
+	map->slots = malloc(count * sizeof(name##_slot_t)); \
+	map->ctrl = calloc(count, 1); \
+	if (map->slots == NULL || map->ctrl == NULL) perror("malloc"), exit(1); \
+	map->mask = count - 1; \
+} \
+\
+/* bytes held by the slots and control bytes */ \
+static inline size_t name##_bytes(name##_t *map) \
+{ \
+	return (map->mask + 1) * (sizeof(name##_slot_t) + 1); \
+} \
+\
+static inline void name##_free(name##_t *map) \
+{ \
+	free(map->slots); \
+	free(map->ctrl); \
+	*map = (name##_t) { 0 }; \
+} \
+\
+/* slot holding key, NULL if absent; h is hash(key) */ \
+static inline name##_slot_t *name##_find_at(name##_t *map, K key, uint64_t h) \
+{ \
+	uint8_t tag = name##_tag(h); \
+	for (size_t i = h & map->mask, n = 0;; i = (i + 1) & map->mask, ++n) \
+	{ \
+		if (map->ctrl[i] == 0) { \
+			__hm_stats_record__(&map->stats, get_probes, n); \
+			return NULL; \
+		} \
+		if (map->ctrl[i] == tag && eq(map->slots[i].key, key)) { \
+			__hm_stats_record__(&map->stats, get_probes, n); \
+			return &map->slots[i]; \
+		} \
+	} \
+} \
+\
+static inline name##_slot_t *name##_find(name##_t *map, K key) \
+{ \
+	return name##_find_at(map, key, hash(key)); \
+} \
+\
+static inline void name##_resize(name##_t *map, size_t capacity) \
+{ \
+	__hm_stats_start__(); \
+	size_t count = 16; \
+	while (count < capacity) count *= 2; \
+	name##_slot_t *slots = malloc(count * sizeof(name##_slot_t)); \
+	uint8_t *ctrl = calloc(count, 1); \
+	if (slots == NULL || ctrl == NULL) perror("malloc"), exit(1); \
+	for (size_t i = 0; i <= map->mask; ++i) \
+	{ \
+		if (map->ctrl[i] == 0) continue; \
+		uint64_t h = hash(map->slots[i].key); \
+		size_t j = h & (count - 1); \
+		while (ctrl[j]) j = (j + 1) & (count - 1); \
+		slots[j] = map->slots[i]; \
+		ctrl[j] = name##_tag(h); \
+	} \
+	free(map->slots); \
+	free(map->ctrl); \
+	map->slots = slots; \
+	map->ctrl = ctrl; \
+	map->mask = count - 1; \
+	__hm_stats_stop__(&map->stats); \
+} \
+\
+/* size the map for n keys, no insert grows it before that */ \
+static inline void name##_reserve(name##_t *map, size_t n) \
+{ \
+	size_t count = map->mask + 1; \
+	while (4 * n > 3 * count) count *= 2; \
+	if (count != map->mask + 1) name##_resize(map, count); \
+} \
+\
+/* insert without growing, the caller keeps the load under 3/4 */ \
+static inline name##_slot_t *name##_insert_at(name##_t *map, K key, uint64_t h) \
+{ \
+	uint8_t tag = name##_tag(h); \
+	for (size_t i = h & map->mask, n = 0;; i = (i + 1) & map->mask, ++n) \
+	{ \
+		if (map->ctrl[i] == tag && eq(map->slots[i].key, key)) { \
+			__hm_stats_record__(&map->stats, put_probes, n); \
+			return &map->slots[i]; \
+		} \
+		if (map->ctrl[i] == 0) { \
+			__hm_stats_record__(&map->stats, put_probes, n); \
+			map->ctrl[i] = tag; \
+			map->slots[i] = (name##_slot_t) { .key = key }; \
+			map->len++; \
+			return &map->slots[i]; \
+		} \
+	} \
+} \
+\
+/* slot holding key, inserted with a zeroed value if absent */ \
+static inline name##_slot_t *name##_insert(name##_t *map, K key) \
+{ \
+	if (4 * (map->len + 1) > 3 * (map->mask + 1)) name##_resize(map, 2 * (map->mask + 1)); \
+	return name##_insert_at(map, key, hash(key)); \
+} \
+\
+static inline V *name##_get(name##_t *map, K key) \
+{ \
+	name##_slot_t *slot = name##_find(map, key); \
+	return slot ? &slot->value : NULL; \
+} \
+\
+static inline void name##_put(name##_t *map, K key, V value) \
+{ \
+	name##_insert(map, key)->value = value; \
+} \
+\
+/* hash a block of keys together, then touch every home slot so the cache \
+   misses overlap instead of stalling each probe */ \
+static inline void name##_prefetch(name##_t *map, const K *keys, size_t n, uint64_t *hashes) \
+{ \
+	name##_hash_batch(keys, n, hashes); \
+	for (size_t i = 0; i < n; ++i) \
+	{ \
+		__builtin_prefetch(&map->ctrl[hashes[i] & map->mask]); \
+		__builtin_prefetch(&map->slots[hashes[i] & map->mask]); \
+	} \
+} \
+\
+/* find every key, out[i] is NULL for a missing one */ \
+static inline void name##_get_batch(name##_t *map, const K *keys, size_t n, name##_slot_t **out) \
+{ \
+	uint64_t hashes[HM_BATCH]; \
+	for (size_t start = 0; start < n; start += HM_BATCH) \
+	{ \
+		size_t block = n - start < HM_BATCH ? n - start : HM_BATCH; \
+		name##_prefetch(map, keys + start, block, hashes); \
+		for (size_t i = 0; i < block; ++i) out[start + i] = name##_find_at(map, keys[start + i], hashes[i]); \
+	} \
+} \
+\
+/* find or insert every key; the map grows for all of them up front, so the \
+   slots in out stay valid together until the next insert or delete */ \
+static inline void name##_insert_batch(name##_t *map, const K *keys, size_t n, name##_slot_t **out) \
+{ \
+	name##_reserve(map, map->len + n); \
+	uint64_t hashes[HM_BATCH]; \
+	for (size_t start = 0; start < n; start += HM_BATCH) \
+	{ \
+		size_t block = n - start < HM_BATCH ? n - start : HM_BATCH; \
+		name##_prefetch(map, keys + start, block, hashes); \
+		for (size_t i = 0; i < block; ++i) out[start + i] = name##_insert_at(map, keys[start + i], hashes[i]); \
+	} \
+} \
+\
+/* remove a slot returned by find or insert */ \
+static inline void name##_del(name##_t *map, name##_slot_t *slot) \
+{ \
+	size_t hole = slot - map->slots; \
+	for (size_t i = (hole + 1) & map->mask; map->ctrl[i]; i = (i + 1) & map->mask) \
+	{ \
+		/* move back every slot whose home is not inside (hole, i] */ \
+		size_t home = hash(map->slots[i].key) & map->mask; \
+		if (((i - home) & map->mask) < ((i - hole) & map->mask)) continue; \
+		map->slots[hole] = map->slots[i]; \
+		map->ctrl[hole] = map->ctrl[i]; \
+		hole = i; \
+	} \
+	map->ctrl[hole] = 0; \
+	map->len--; \
+}
+
+// DEFINE_HASHMAP with a long int count as the value and name##_inc to bump it
+#define DEFINE_COUNTING_HASHMAP(name, K, hash, eq) \
+DEFINE_HASHMAP(name, K, long int, hash, eq) \
+\
+/* add delta to key's count and return the new count */ \
+static inline long int name##_inc(name##_t *map, K key, long int delta) \
+{ \
+	return name##_insert(map, key)->value += delta; \
+} \
+\
+/* add delta to the count of every key */ \
+static inline void name##_inc_batch(name##_t *map, const K *keys, size_t n, long int delta) \
+{ \
+	name##_reserve(map, map->len + n); \
+	uint64_t hashes[HM_BATCH]; \
+	for (size_t start = 0; start < n; start += HM_BATCH) \
+	{ \
+		size_t block = n - start < HM_BATCH ? n - start : HM_BATCH; \
+		name##_prefetch(map, keys + start, block, hashes); \
+		for (size_t i = 0; i < block; ++i) name##_insert_at(map, keys[start + i], hashes[i])->value += delta; \
+	} \
+}
+
+// DEFINE_STRIPED_HASHMAP(name, base, K, hash, bits) generates name##_t, one
+// table that threads fill together: 1 << bits maps of the DEFINE_HASHMAP type
+// base##_t, each behind its own lock. A key lives in the stripe picked by the
+// top bits of hash(key), so no key is held twice and threads only wait on
+// each other within a stripe. name##_lock hands out a stripe's map to use
+// with the base##_ functions until name##_unlock.
+#define DEFINE_STRIPED_HASHMAP(name, base, K, hash, bits) \
+typedef struct { \
+	base##_t map; \
+	pthread_mutex_t lock; \
+} name##_stripe_t; \
+\
+typedef struct { \
+	name##_stripe_t stripes[1 << (bits)]; \
+} name##_t; \
+\
+/* room for about `capacity` keys in total, spread over the stripes */ \
+static inline void name##_init(name##_t *table, size_t capacity) \
+{ \
+	for (size_t s = 0; s < (1 << (bits)); ++s) \
+	{ \
+		base##_init(&table->stripes[s].map, 0); \
+		base##_reserve(&table->stripes[s].map, (capacity >> (bits)) + 1); \
+		pthread_mutex_init(&table->stripes[s].lock, NULL); \
+	} \
+} \
+\
+static inline void name##_free(name##_t *table) \
+{ \
+	for (size_t s = 0; s < (1 << (bits)); ++s) \
+	{ \
+		base##_free(&table->stripes[s].map); \
+		pthread_mutex_destroy(&table->stripes[s].lock); \
+	} \
+} \
+\
+static inline size_t name##_stripe(K key) \
+{ \
+	return hash(key) >> (64 - (bits)); \
+} \
+\
+static inline base##_t *name##_lock(name##_t *table, size_t stripe) \
+{ \
+	pthread_mutex_lock(&table->stripes[stripe].lock); \
+	return &table->stripes[stripe].map; \
+} \
+\
+static inline void name##_unlock(name##_t *table, size_t stripe) \
+{ \
+	pthread_mutex_unlock(&table->stripes[stripe].lock); \
+} \
+\
+/* keys in all stripes, only meaningful while no thread is adding */ \
+static inline size_t name##_len(name##_t *table) \
+{ \
+	size_t len = 0; \
+	for (size_t s = 0; s < (1 << (bits)); ++s) len += table->stripes[s].map.len; \
+	return len; \
+}
+
 void *__dynamic_array_resize_array__(void *array);
 
+void *__darray_reserve__(void *array, size_t n);
+
+// make room for `n` items in total, no darray_push reallocates before that
+#define darray_reserve(array, n) do { \
+	array = __darray_reserve__(array, n); \
+} while(0)
+
 #define darray_push(array, item) { \
 	array = __dynamic_array_resize_array__(array); \
 	darray_t *meta = __darray_get_meta__(array); \
 	array[meta->index++] = item; \
 }
 
+void *__darray_extend__(void *array, const void *items, size_t n);
+
+// append `n` items from `items` with one grow and one copy
+#define darray_extend(array, items, n) do { \
+	array = __darray_extend__(array, items, n); \
+} while(0)
+
+// append `n` uninitialized items with one grow, evaluates to the first of them
+#define darray_push_n(array, n) ({ \
+	size_t __n = (n); \
+	array = __darray_reserve__(array, darray_len(array) + __n); \
+	darray_t *meta = __darray_get_meta__(array); \
+	meta->index += __n; \
+	array + meta->index - __n; \
+})
+
 typedef enum {
 	BLACK 	= 0,
 	RED 		= 1,
@@ -190,55 +645,138 @@ typedef struct {
 	struct bucket {
 		size_t index;
 		size_t size;
-		uint8_t filled;
+		uint8_t filled; // 2 once deleted
+#ifdef HM_ROBIN_HOOD
+		uint32_t dist;  // buckets away from the home bucket of the key
+#endif
 	} *buckets;
+#ifdef HM_SWISS
+	uint8_t *ctrl; // per bucket: HM_EMPTY or the top 7 bits of the hash
+#endif
 	uint32_t seed;
 	size_t item_size;
 	size_t count;
 	size_t initial_size;
+	size_t tombstones; // deleted buckets, only reclaimed by a rehash
+#ifdef HM_INCREMENTAL
+	struct bucket *old_buckets; // table being drained, NULL when no rehash is running
+#ifdef HM_SWISS
+	uint8_t *old_ctrl;
+#endif
+	size_t old_count;
+	size_t migrated; // old buckets moved so far
+#endif
+#ifdef HM_STATS
+	hm_stats_t stats;
+#endif
 	size_t index;
 } hashmap_t;
 
 typedef struct {
 	size_t item_size;
 	size_t count;
+	size_t reserved; // bytes of address space behind an init_darray_mapped array, 0 on the heap
 	size_t index;
 } darray_t;
 
+// mapped arrays commit memory in steps of this many bytes, one huge page
+#define DARRAY_COMMIT_STEP (2 * 1024 * 1024)
+
+// bump allocator for short lived strings, everything allocated after a mark
+// goes at once when the mark is released
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+typedef struct arena_block {
+	struct arena_block *prev;
+	size_t size;
+	size_t used;
+	_Alignas(max_align_t) char data[];
+} arena_block_t;
+
+typedef struct {
+	arena_block_t *block; // newest block, allocations come from its tail
+} arena_t;
+
+typedef struct {
+	arena_block_t *block;
+	size_t used;
+} arena_mark_t;
+
+// formate_string, join_string, sub_string and the log macros allocate here;
+// one per thread, so helpers never race on it
+extern _Thread_local arena_t build_arena;
+
+// release everything `build_arena` handed out in the rest of the enclosing scope
+#define arena_scope() arena_mark_t __arena_scope__ defer(__arena_scope_release__) = arena_mark(&build_arena)
+
 void *__hashmap_get_meta__(void *KVs);
 void *__hashmap_get_map__(void *KVs);
+size_t __hm_probe__(void *KVs, uint64_t hash, const void *key, size_t key_size, size_t key_offset, bool *found);
+void __hm_claim__(hashmap_t *hm, size_t slot, uint64_t hash, size_t key_size, size_t index);
+void __hm_remove__(void *KVs, size_t slot, size_t key_size, size_t key_offset);
+void *__hm_rehash__(void *KVs, size_t count, size_t key_size, size_t key_offset);
+void *__hm_grow__(void *KVs, size_t count, size_t key_size, size_t key_offset);
+#ifdef HM_INCREMENTAL
+void __hm_migrate__(void *KVs, size_t steps, size_t key_offset);
+#define __hm_step__(map) __hm_migrate__(map, HM_MIGRATE_STEP, hm_key_offset(map))
+#else
+#define __hm_step__(map) ((void)0)
+#endif
 size_t hm_len(void *KVs);
+double hm_load(void *KVs);
+double hm_tombstone_ratio(void *KVs);
 void hm_free(void *KVs);
 void hm_reset(void *KVs);
 void *__darray_get_meta__(void *array);
 void *__darray_get_array__(void *array);
 void darray_reset(void *array);
 size_t darray_len(void *array);
+size_t darray_bytes(void *array);
 void darray_free(void *array);
 
 // build files
 extern const char *build_source;
 extern const char *build_bin;
 
-// color for logging
+// arena allocation, aligned for any type
+void *arena_alloc(arena_t *arena, size_t size);
+
+// remember the current top of the arena
+arena_mark_t arena_mark(arena_t *arena);
+
+// drop everything allocated since `mark`
+void arena_release(arena_t *arena, arena_mark_t mark);
+
+// drop everything, the first block is kept for reuse
+void arena_reset(arena_t *arena);
+
+// give every block back
+void arena_free(arena_t *arena);
+
+void __arena_scope_release__(arena_mark_t *mark);
+
+// color for logging, a static string
 const char *get_term_color(TERM_KIND kind, TERM_COLOR color);
 
-// macro-related function for formating string
+// macro-related function for formating string, the result lives in
+// `build_arena` and must not be free()d
 char *__formate_string_function__(char *s, ...);
 
-// string join
+// string join, arena memory, do not free()
 char *join_string(const char *s0, const char *s1);
 
-// string sub-string
+// string sub-string, arena memory, do not free()
 char *sub_string(const char *s, size_t fp, size_t tp);
 
 // string replace
 char *replace_char_in_string(char *s, unsigned char from, unsigned char to);
 
-// convert (const char **) to (const char *)
+// convert (const char **) to (const char *), arena memory, do not free()
 const char *string_list_to_const_string(const char **string_list, size_t len, unsigned char sep);
 
-// convert const string to array with seprator
+// convert const string to array with seprator; free the array with
+// darray_free, its strings are arena memory and die with the enclosing scope
 const char **string_to_array(const char *string, unsigned char sep);
 
 // exectue command in the shell
@@ -256,10 +794,11 @@ bool is_directory_exists(const char *path);
 // create new directory (it will create all directory in the path)
 void create_directory(const char *path);
 
-// get files in array
+// get files in array; free the array with darray_free, its strings are arena
+// memory and die with the enclosing scope
 const char **get_files(const char *from);
 
-// get files with specific extention
+// get files with specific extention, same ownership as get_files
 const char **get_files_with_specific_ext(const char *from, const char *ext);
 
 // convert string list to array
@@ -277,6 +816,10 @@ time_t get_time_from_file(const char *path);
 // init dynamic array
 void *init_darray(void *array, size_t initial_size, size_t item_size);
 
+// init dynamic array that reserves address space for `max_items` up front and
+// commits it as it grows, so growing never copies; asks for transparent huge pages
+void *init_darray_mapped(void *array, size_t max_items, size_t item_size);
+
 // init hashmap
 void *init_hm(void *map, size_t initial_size, size_t item_size, hash_function_t hf, compare_function_t hc, uint32_t seed);
 
@@ -302,63 +845,103 @@ int cmp_hash(const void *a, const void *b, size_t size);
 *																   The Actual Implementation
 **********************************************************************************************/
 
+#define __TERM_COLORS__(pre, post) { \
+	pre "0" post, pre "1" post, pre "2" post, pre "3" post, \
+	pre "4" post, pre "5" post, pre "6" post, pre "7" post }
+
 const char *get_term_color(TERM_KIND kind, TERM_COLOR color)
 {
-	switch (kind)
-	{
-		case TEXT: return formate_string((char *)"\e[0;3%dm", color);
-		case BOLD_TEXT: return formate_string((char *)"\e[1;3%dm", color);
-		case UNDERLINE_TEXT: return formate_string((char *)"\e[4;3%dm", color);
-		case BACKGROUND: return formate_string((char *)"\e[4%dm", color);
-		case HIGH_INTEN_BG: return formate_string((char *)"\e[0;10%dm", color);
-		case HIGH_INTEN_TEXT: return formate_string((char *)"\e[0;9%dm", color);
-		case BOLD_HIGH_INTEN_TEXT: return formate_string((char *)"\e[1;9%dm", color);
-		case RESET: return formate_string((char *)"\e[0m");
+	static const char *colors[RESET][8] = {
+		[TEXT] = __TERM_COLORS__("\e[0;3", "m"),
+		[BOLD_TEXT] = __TERM_COLORS__("\e[1;3", "m"),
+		[UNDERLINE_TEXT] = __TERM_COLORS__("\e[4;3", "m"),
+		[BACKGROUND] = __TERM_COLORS__("\e[4", "m"),
+		[HIGH_INTEN_BG] = __TERM_COLORS__("\e[0;10", "m"),
+		[HIGH_INTEN_TEXT] = __TERM_COLORS__("\e[0;9", "m"),
+		[BOLD_HIGH_INTEN_TEXT] = __TERM_COLORS__("\e[1;9", "m"),
+	};
+
+	if (kind == RESET) return "\e[0m";
+	if ((unsigned)kind >= RESET || (unsigned)color > WHITE) return "";
+	return colors[kind][color];
+}
+
+_Thread_local arena_t build_arena;
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+	arena_block_t *block = arena->block;
+	size_t offset = block ? (block->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1) : 0;
+	if (block == NULL || offset + size > block->size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(arena_block_t) + block_size);
+		if (block == NULL) {
+			perror("failed to allocate arena block: ");
+			return NULL;
+		}
+		block->prev = arena->block;
+		block->size = block_size;
+		block->used = 0;
+		arena->block = block;
+		offset = 0;
 	}
 
-	return "";
+	void *p = block->data + offset;
+	block->used = offset + size;
+	return p;
 }
 
-char *__formate_string_function__(char *s, ...)
+arena_mark_t arena_mark(arena_t *arena)
 {
-	// allocate small size buffer
-	size_t buffer_size = 64; // bytes
-	char *buffer = (char *)malloc(buffer_size);
+	return (arena_mark_t) { .block = arena->block, .used = arena->block ? arena->block->used : 0 };
+}
 
-	if (buffer == NULL)
+void arena_release(arena_t *arena, arena_mark_t mark)
+{
+	while (arena->block != mark.block)
 	{
-		perror("failed to allocate memory for formating string: ");
-		return NULL;
+		arena_block_t *prev = arena->block->prev;
+		free(arena->block);
+		arena->block = prev;
 	}
+	if (arena->block) arena->block->used = mark.used;
+}
 
-	va_list ap;
-	va_start(ap, s);
-
-	size_t nSize = vsnprintf(buffer, buffer_size, s, ap);
-	if (!nSize)
+void arena_reset(arena_t *arena)
+{
+	while (arena->block && arena->block->prev)
 	{
-		free(buffer);
-		va_end(ap);
+		arena_block_t *prev = arena->block->prev;
+		free(arena->block);
+		arena->block = prev;
 	}
+	if (arena->block) arena->block->used = 0;
+}
 
-	// if buffer does not have enough space then extend it.
-	if (nSize >= buffer_size)
-	{
-		buffer_size = nSize + 1;
-		buffer = (char*)realloc(buffer, buffer_size);
+void arena_free(arena_t *arena)
+{
+	arena_release(arena, (arena_mark_t) { 0 });
+}
 
-		if (buffer == NULL)
-		{
-			perror("failed to extend buffer for allocating formated string: ");
-			va_end(ap);
+void __arena_scope_release__(arena_mark_t *mark)
+{
+	arena_release(&build_arena, *mark);
+}
 
-			return NULL;
-		}
+char *__formate_string_function__(char *s, ...)
+{
+	va_list ap;
+	va_start(ap, s);
+	int size = vsnprintf(NULL, 0, s, ap);
+	va_end(ap);
 
-		va_start(ap, s);
-		vsnprintf(buffer, buffer_size, s, ap);
-	}
+	if (size < 0) return NULL;
+
+	char *buffer = arena_alloc(&build_arena, size + 1);
+	if (buffer == NULL) return NULL;
 
+	va_start(ap, s);
+	vsnprintf(buffer, size + 1, s, ap);
 	va_end(ap);
 
 	return buffer;
@@ -366,10 +949,11 @@ char *__formate_string_function__(char *s, ...)
 
 char *join_string(const char *s0, const char *s1)
 {
-	char *s = (char *)malloc(strlen(s0) + strlen(s1) + 1);
+	size_t n0 = strlen(s0), n1 = strlen(s1);
+	char *s = arena_alloc(&build_arena, n0 + n1 + 1);
 
-	s = strcpy(s, s0);
-	s = strcat(s, s1);
+	memcpy(s, s0, n0);
+	memcpy(s + n0, s1, n1 + 1);
 
 	return s;
 }
@@ -378,9 +962,8 @@ char *sub_string(const char *s, size_t fp, size_t tp)
 {
 	if (fp >= tp) return NULL;
 
-	char *sub = (char *)malloc((tp - fp) + 1);
-	for (size_t i = 0; i < tp - fp; ++i)
-		sub[i] = s[fp + i];
+	char *sub = arena_alloc(&build_arena, (tp - fp) + 1);
+	memcpy(sub, s + fp, tp - fp);
 
 	sub[(tp - fp)] = '\0';
 	
@@ -403,12 +986,13 @@ const char *string_list_to_const_string(const char **string_list, size_t len, un
 	for (size_t i = 0; i < len; ++i)
 		total_size_of_string += strlen(string_list[i]) + 1;
 
-	char *string = (char *)malloc(total_size_of_string + 1);
+	char *string = arena_alloc(&build_arena, total_size_of_string + 1);
 	size_t pos = 0;
 	for (size_t i = 0; i < len; ++i)
 	{
-		string = strcat(string, string_list[i]);
-		pos += strlen(string_list[i]) + 1;
+		size_t size = strlen(string_list[i]);
+		memcpy(string + pos, string_list[i], size);
+		pos += size + 1;
 		string[pos - 1] = sep;
 	}
 
@@ -667,11 +1251,53 @@ void *init_darray(void *array, size_t initial_size, size_t item_size)
 	array = malloc(sizeof(darray_t) + initial_size * item_size);
 	((darray_t*)array)->item_size = item_size;
 	((darray_t*)array)->count = initial_size;
+	((darray_t*)array)->reserved = 0;
 	((darray_t*)array)->index = 0;
 
 	return __darray_get_array__(array);
 }
 
+// make the first `count` items of a mapped array writable, as far as the
+// reservation goes; only the first `need` of them have to fit
+darray_t *__darray_commit__(darray_t *da, size_t count, size_t need)
+{
+	size_t bytes = sizeof(darray_t) + count * da->item_size;
+	bytes = (bytes + DARRAY_COMMIT_STEP - 1) / DARRAY_COMMIT_STEP * DARRAY_COMMIT_STEP;
+	if (bytes > da->reserved) bytes = da->reserved;
+	if (sizeof(darray_t) + need * da->item_size > bytes) {
+		fprintf(stderr, "mapped array outgrew the %zu bytes reserved for it\n", da->reserved);
+		exit(1);
+	}
+
+	if (mprotect(da, bytes, PROT_READ | PROT_WRITE) != 0)
+		perror("failed to commit mapped array: "), exit(1);
+	da->count = (bytes - sizeof(darray_t)) / da->item_size;
+	return da;
+}
+
+void *init_darray_mapped(void *array, size_t max_items, size_t item_size)
+{
+	(void)array;
+	size_t reserved = sizeof(darray_t) + max_items * item_size;
+	reserved = (reserved + DARRAY_COMMIT_STEP - 1) / DARRAY_COMMIT_STEP * DARRAY_COMMIT_STEP;
+
+	// address space only, pages are committed by __darray_commit__ and backed on first touch
+	darray_t *da = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (da == MAP_FAILED) perror("failed to reserve mapped array: "), exit(1);
+#ifdef MADV_HUGEPAGE
+	madvise(da, reserved, MADV_HUGEPAGE);
+#endif
+	if (mprotect(da, sizeof(darray_t), PROT_READ | PROT_WRITE) != 0)
+		perror("failed to commit mapped array: "), exit(1);
+
+	da->item_size = item_size;
+	da->reserved = reserved;
+	da->index = 0;
+	__darray_commit__(da, 1, 1);
+
+	return __darray_get_array__(da);
+}
+
 void *__darray_get_meta__(void *array)
 {
 	return array - (offsetof(darray_t, index) + sizeof(((darray_t*)0)->index));
@@ -692,12 +1318,19 @@ void darray_reset(void *array)
 
 void darray_free(void *array)
 {
-	free((darray_t*)__darray_get_meta__(array));
+	darray_t *da = (darray_t*)__darray_get_meta__(array);
+	if (da->reserved) munmap(da, da->reserved);
+	else free(da);
 }
 
 void *__dynamic_array_resize_array__(void *array)
 {
 	darray_t *da = (darray_t*)__darray_get_meta__(array);
+	if (da->reserved) {
+		// growing in place copies nothing, so every committed item is used first
+		if (da->index < da->count) return array;
+		return __darray_get_array__(__darray_commit__(da, da->count * POWER_FACTOR, da->index + 1));
+	}
 	if (((float)da->index / (float)da->count) >= LOAD_FACTOR) {
 		da->count *= POWER_FACTOR;
 		da = (darray_t*)realloc(da, sizeof(darray_t) + da->count * da->item_size);
@@ -706,38 +1339,107 @@ void *__dynamic_array_resize_array__(void *array)
 	return array;
 }
 
+void *__darray_reserve__(void *array, size_t n)
+{
+	darray_t *da = (darray_t*)__darray_get_meta__(array);
+	if (da->reserved) return n <= da->count ? array : __darray_get_array__(__darray_commit__(da, n, n));
+
+	size_t count = da->count;
+	while ((float)n / (float)count >= LOAD_FACTOR) count *= POWER_FACTOR;
+	if (count == da->count) return array;
+
+	da = (darray_t*)realloc(da, sizeof(darray_t) + count * da->item_size);
+	da->count = count;
+	return __darray_get_array__(da);
+}
+
+void *__darray_extend__(void *array, const void *items, size_t n)
+{
+	array = __darray_reserve__(array, darray_len(array) + n);
+	darray_t *da = (darray_t*)__darray_get_meta__(array);
+	memcpy((char*)array + da->index * da->item_size, items, n * da->item_size);
+	da->index += n;
+	return array;
+}
+
 size_t darray_len(void *array)
 {
 	return ((darray_t*)__darray_get_meta__(array))->index;
 }
 
+// bytes allocated (committed, for a mapped array) including the header
+size_t darray_bytes(void *array)
+{
+	darray_t *da = (darray_t*)__darray_get_meta__(array);
+	return sizeof(darray_t) + da->count * da->item_size;
+}
+
 // init hashmap
 void *init_hm(void *map, size_t initial_size, size_t item_size, hash_function_t hf, compare_function_t hc, uint32_t seed)
 {
-	map = malloc(sizeof(hashmap_t) + initial_size * item_size);
-	((hashmap_t*)map)->buckets = malloc(initial_size * sizeof(struct bucket));
-	((hashmap_t*)map)->count = initial_size;
+	// probing masks the hash, so the bucket count has to be a power of two
+	size_t count = 1;
+	while (count < initial_size) count *= 2;
+#ifdef HM_SWISS
+	if (count < HM_GROUP) count = HM_GROUP;
+	initial_size = count;
+#endif
+	map = malloc(sizeof(hashmap_t) + count * item_size);
+	((hashmap_t*)map)->buckets = malloc(count * sizeof(struct bucket));
+#ifdef HM_SWISS
+	((hashmap_t*)map)->ctrl = malloc(count);
+	memset(((hashmap_t*)map)->ctrl, HM_EMPTY, count);
+#endif
+	((hashmap_t*)map)->count = count;
+	((hashmap_t*)map)->tombstones = 0;
+#ifdef HM_INCREMENTAL
+	((hashmap_t*)map)->old_buckets = NULL;
+#ifdef HM_SWISS
+	((hashmap_t*)map)->old_ctrl = NULL;
+#endif
+	((hashmap_t*)map)->old_count = 0;
+	((hashmap_t*)map)->migrated = 0;
+#endif
 	((hashmap_t*)map)->index = 0;
+#ifdef HM_STATS
+	memset(&((hashmap_t*)map)->stats, 0, sizeof(hm_stats_t));
+#endif
 	((hashmap_t*)map)->hf = hf;
 	((hashmap_t*)map)->hc = hc;
 	((hashmap_t*)map)->initial_size = initial_size;
 	((hashmap_t*)map)->seed = seed;
 	((hashmap_t*)map)->item_size = item_size;
-	memset(((hashmap_t*)map)->buckets, 0, sizeof(struct bucket) * initial_size);
+	memset(((hashmap_t*)map)->buckets, 0, sizeof(struct bucket) * count);
 	return __hashmap_get_map__(map);
 }
 
 void hm_reset(void *KVs)
 {
 	if (KVs != NULL && ((hashmap_t*)__hashmap_get_meta__(KVs))->index) {
+#ifdef HM_INCREMENTAL
+		((hashmap_t*)__hashmap_get_meta__(KVs))->migrated = ((hashmap_t*)__hashmap_get_meta__(KVs))->old_count;
+		__hm_migrate__(KVs, 1, 0);
+#endif
 		KVs = __hashmap_get_meta__(KVs);
 		((hashmap_t*)KVs)->index = 0;
+		((hashmap_t*)KVs)->tombstones = 0;
 		memset(((hashmap_t*)KVs)->buckets, 0, sizeof(struct bucket) * ((hashmap_t*)KVs)->count);
+#ifdef HM_SWISS
+		memset(((hashmap_t*)KVs)->ctrl, HM_EMPTY, ((hashmap_t*)KVs)->count);
+#endif
 	}
 }
 
 void hm_free(void *KVs)
 {
+#ifdef HM_INCREMENTAL
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	hm->migrated = hm->old_count;
+	__hm_migrate__(KVs, 1, 0);
+#endif
+#ifdef HM_SWISS
+	free(((hashmap_t*)__hashmap_get_meta__(KVs))->ctrl);
+#endif
 	free(((hashmap_t*)__hashmap_get_meta__(KVs))->buckets);
 	free((hashmap_t*)__hashmap_get_meta__(KVs));
 }
@@ -747,6 +1449,20 @@ size_t hm_len(void *KVs)
 	return ((hashmap_t*)__hashmap_get_meta__(KVs))->index;
 }
 
+// live entries per bucket
+double hm_load(void *KVs)
+{
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	return (double)hm->index / (double)hm->count;
+}
+
+// deleted buckets per bucket, hm_put counts them towards the load
+double hm_tombstone_ratio(void *KVs)
+{
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	return (double)hm->tombstones / (double)hm->count;
+}
+
 // fnv-1a hash function
 uint64_t fnv_1a_hash(const void *bytes, size_t size, uint32_t seed)
 {
@@ -766,10 +1482,10 @@ uint64_t MURMUR3_64(const void *key, size_t len, uint32_t seed)
     const uint64_t c1 = 0x87c37b91114253d5;
     const uint64_t c2 = 0x4cf5ad432745937f;
 
-    // Process each 8-byte block
-    const uint64_t *blocks = (const uint64_t *)(data);
+    // Process each 8-byte block, keys need not be 8-byte aligned
     for (int i = 0; i < nblocks; i++) {
-        uint64_t k1 = blocks[i];
+        uint64_t k1;
+        memcpy(&k1, data + i * 8, sizeof(k1));
 
         // Mix the block
         k1 *= c1;
@@ -893,6 +1609,294 @@ void *__hashmap_get_map__(void *KVs)
 	return KVs + (offsetof(hashmap_t, index) + sizeof(((hashmap_t*)0)->index));
 }
 
+#ifdef HM_SWISS
+// bit i is set when control byte i of the group equals `byte`
+static inline uint32_t __hm_group_match__(const uint8_t *ctrl, uint8_t byte)
+{
+#if defined(__AVX2__)
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)ctrl), _mm256_set1_epi8(byte)));
+#elif defined(__SSE2__)
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)ctrl), _mm_set1_epi8(byte)));
+#else
+	uint32_t match = 0;
+	for (int i = 0; i < HM_GROUP; ++i)
+		match |= (uint32_t)(ctrl[i] == byte) << i;
+	return match;
+#endif
+}
+#endif
+
+// probe one bucket table of the map
+size_t __hm_probe_in__(void *KVs, struct bucket *buckets, const uint8_t *ctrl, size_t count, uint64_t hash, const void *key, size_t key_size, size_t key_offset, bool *found)
+{
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	*found = false;
+
+#ifdef HM_SWISS
+	uint8_t fragment = hash >> 57;
+	size_t groups = count / HM_GROUP;
+	size_t group = (hash & (count - 1)) / HM_GROUP;
+	for (size_t c = 0; c < groups; ++c)
+	{
+		group = (group + c) & (groups - 1);
+		const uint8_t *group_ctrl = ctrl + group * HM_GROUP;
+
+		for (uint32_t match = __hm_group_match__(group_ctrl, fragment); match; match &= match - 1)
+		{
+			size_t slot = group * HM_GROUP + __builtin_ctz(match);
+			if (hm->hc(key, (char*)KVs + buckets[slot].index * hm->item_size + key_offset, key_size)) {
+				__hm_stats_probe__(&hm->stats, c);
+				*found = true;
+				return slot;
+			}
+		}
+
+		// a group with room left ends every probe sequence passing through it
+		uint32_t empty = __hm_group_match__(group_ctrl, HM_EMPTY);
+		if (empty) {
+			__hm_stats_probe__(&hm->stats, c);
+			return group * HM_GROUP + __builtin_ctz(empty);
+		}
+	}
+#elif defined(HM_ROBIN_HOOD)
+	(void)ctrl;
+	size_t index = hash & (count - 1);
+	for (size_t dist = 0; dist < count; ++dist, index = (index + 1) & (count - 1))
+	{
+		// the run is ordered by distance, the key would have been placed before this
+		if (!buckets[index].filled || buckets[index].dist < dist) {
+			__hm_stats_probe__(&hm->stats, dist);
+			return index;
+		}
+		if (key_size == buckets[index].size && hm->hc(key, (char*)KVs + buckets[index].index * hm->item_size + key_offset, key_size)) {
+			__hm_stats_probe__(&hm->stats, dist);
+			*found = true;
+			return index;
+		}
+	}
+#else
+	(void)ctrl;
+	size_t index = hash & (count - 1);
+	for (size_t c = 0; c < count; ++c)
+	{
+		index = (index + c) & (count - 1);
+		if (!buckets[index].filled) {
+			__hm_stats_probe__(&hm->stats, c);
+			return index;
+		}
+		if (key_size == buckets[index].size && hm->hc(key, (char*)KVs + buckets[index].index * hm->item_size + key_offset, key_size)) {
+			__hm_stats_probe__(&hm->stats, c);
+			*found = true;
+			return index;
+		}
+	}
+#endif
+
+	// the load factor keeps buckets free, so this is never reached
+	return count;
+}
+
+#ifdef HM_SWISS
+#define __hm_ctrl__(ctrl) (ctrl)
+#else
+#define __hm_ctrl__(ctrl) NULL
+#endif
+
+// bucket holding `key` if `found`, otherwise the empty bucket it belongs in
+size_t __hm_probe__(void *KVs, uint64_t hash, const void *key, size_t key_size, size_t key_offset, bool *found)
+{
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+#ifdef HM_STATS
+	hm->stats.probe = 0;
+#endif
+	size_t slot = __hm_probe_in__(KVs, hm->buckets, __hm_ctrl__(hm->ctrl), hm->count, hash, key, key_size, key_offset, found);
+
+#ifdef HM_INCREMENTAL
+	if (!*found && hm->old_buckets) {
+		size_t old = __hm_probe_in__(KVs, hm->old_buckets, __hm_ctrl__(hm->old_ctrl), hm->old_count, hash, key, key_size, key_offset, found);
+
+		// an entry found in the old table moves over right away, so callers
+		// only ever see buckets of the current one
+		if (*found) {
+			__hm_claim__(hm, slot, hash, key_size, hm->old_buckets[old].index);
+			hm->old_buckets[old].size = 0;
+			hm->old_buckets[old].filled = 2;
+#ifdef HM_SWISS
+			hm->old_ctrl[old] = HM_DELETED;
+#endif
+		}
+	}
+#endif
+	return slot;
+}
+
+#ifdef HM_INCREMENTAL
+// move up to `steps` buckets of the old table into the current one, the old
+// table goes once it is empty
+void __hm_migrate__(void *KVs, size_t steps, size_t key_offset)
+{
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	if (hm->old_buckets == NULL) return;
+
+	__hm_stats_start__();
+	for (; steps > 0 && hm->old_buckets; --steps)
+	{
+		if (hm->migrated == hm->old_count) {
+			free(hm->old_buckets);
+			hm->old_buckets = NULL;
+#ifdef HM_SWISS
+			free(hm->old_ctrl);
+			hm->old_ctrl = NULL;
+#endif
+			break;
+		}
+
+		struct bucket bkt = hm->old_buckets[hm->migrated++];
+		if (bkt.filled != 1) continue;
+
+		const void *key = (char*)KVs + bkt.index * hm->item_size + key_offset;
+		uint64_t hash = hm->hf(key, bkt.size, hm->seed);
+
+		bool found;
+		size_t slot = __hm_probe_in__(KVs, hm->buckets, __hm_ctrl__(hm->ctrl), hm->count, hash, key, bkt.size, key_offset, &found);
+		__hm_claim__(hm, slot, hash, bkt.size, bkt.index);
+	}
+	__hm_stats_time__(&hm->stats);
+}
+#endif
+
+// point an empty bucket at KV entry `index`
+void __hm_claim__(hashmap_t *hm, size_t slot, uint64_t hash, size_t key_size, size_t index)
+{
+#if defined(HM_ROBIN_HOOD)
+	// take the bucket and push the rest of the run along, an entry further
+	// from its home keeps its bucket over one that is closer
+	size_t mask = hm->count - 1;
+	struct bucket carry = { .index = index, .size = key_size, .filled = 1, .dist = (slot - (hash & mask)) & mask };
+	for (;; slot = (slot + 1) & mask, carry.dist++)
+	{
+		if (!hm->buckets[slot].filled) {
+			hm->buckets[slot] = carry;
+			return;
+		}
+		if (hm->buckets[slot].dist < carry.dist) SWAP(struct bucket, hm->buckets[slot], carry);
+	}
+#else
+#ifdef HM_SWISS
+	hm->ctrl[slot] = hash >> 57;
+#else
+	(void)hash;
+#endif
+	hm->buckets[slot].size = key_size;
+	hm->buckets[slot].index = index;
+	hm->buckets[slot].filled = 1;
+#endif
+}
+
+// tombstone bucket `slot` and fill the hole in the dense array with the last entry
+void __hm_remove__(void *KVs, size_t slot, size_t key_size, size_t key_offset)
+{
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	size_t place = hm->buckets[slot].index;
+	size_t last = hm->index - 1;
+
+#if defined(HM_ROBIN_HOOD)
+	// shift the rest of the run back a bucket, no tombstone needed
+	size_t mask = hm->count - 1;
+	size_t next = (slot + 1) & mask;
+	for (; hm->buckets[next].filled && hm->buckets[next].dist > 0; slot = next, next = (next + 1) & mask)
+	{
+		hm->buckets[slot] = hm->buckets[next];
+		hm->buckets[slot].dist--;
+	}
+	memset(&hm->buckets[slot], 0, sizeof(struct bucket));
+#else
+#ifdef HM_SWISS
+	hm->ctrl[slot] = HM_DELETED;
+#endif
+	hm->buckets[slot].size = 0;
+	hm->buckets[slot].filled = 2;
+	hm->tombstones++;
+#endif
+
+	if (place != last) {
+		const void *key = (char*)KVs + last * hm->item_size + key_offset;
+		bool found;
+		size_t moved = __hm_probe__(KVs, hm->hf(key, key_size, hm->seed), key, key_size, key_offset, &found);
+		hm->buckets[moved].index = place;
+		memcpy((char*)KVs + place * hm->item_size, (char*)KVs + last * hm->item_size, hm->item_size);
+	}
+	hm->index--;
+}
+
+// move to `count` buckets (a power of two) and rebucket every entry, tombstones are dropped
+void *__hm_rehash__(void *KVs, size_t count, size_t key_size, size_t key_offset)
+{
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	__hm_stats_start__();
+#ifdef HM_INCREMENTAL
+	// every entry is rebucketed from the dense array anyway
+	hm->migrated = hm->old_count;
+	__hm_migrate__(KVs, 1, key_offset);
+#endif
+	hm->count = count;
+	hm->tombstones = 0;
+	hm = realloc(hm, sizeof(hashmap_t) + hm->count * hm->item_size);
+	KVs = __hashmap_get_map__(hm);
+
+	free(hm->buckets);
+	hm->buckets = malloc(sizeof(struct bucket) * hm->count);
+	memset(hm->buckets, 0, sizeof(struct bucket) * hm->count);
+#ifdef HM_SWISS
+	free(hm->ctrl);
+	hm->ctrl = malloc(hm->count);
+	memset(hm->ctrl, HM_EMPTY, hm->count);
+#endif
+
+	for (size_t i = 0; i < hm->index; ++i)
+	{
+		const void *key = (char*)KVs + i * hm->item_size + key_offset;
+		uint64_t hash = hm->hf(key, key_size, hm->seed);
+
+		bool found;
+		size_t slot = __hm_probe__(KVs, hash, key, key_size, key_offset, &found);
+		__hm_claim__(hm, slot, hash, key_size, i);
+	}
+	__hm_stats_stop__(&hm->stats);
+	return KVs;
+}
+
+// called by hm_put at the load factor: a full rehash, or with HM_INCREMENTAL
+// a fresh bucket table that later operations fill from the old one
+void *__hm_grow__(void *KVs, size_t count, size_t key_size, size_t key_offset)
+{
+#ifdef HM_INCREMENTAL
+	hashmap_t *hm = __hashmap_get_meta__(KVs);
+	__hm_migrate__(KVs, SIZE_MAX, key_offset);
+	(void)key_size;
+	__hm_stats_start__();
+
+	hm->old_buckets = hm->buckets;
+	hm->old_count = hm->count;
+	hm->migrated = 0;
+#ifdef HM_SWISS
+	hm->old_ctrl = hm->ctrl;
+	hm->ctrl = malloc(count);
+	memset(hm->ctrl, HM_EMPTY, count);
+#endif
+	// calloc hands big tables out as fresh zero pages, nothing to clear up front
+	hm->buckets = calloc(count, sizeof(struct bucket));
+	hm->count = count;
+	hm->tombstones = 0;
+
+	hm = realloc(hm, sizeof(hashmap_t) + hm->count * hm->item_size);
+	__hm_stats_stop__(&hm->stats);
+	return __hashmap_get_map__(hm);
+#else
+	return __hm_rehash__(KVs, count, key_size, key_offset);
+#endif
+}
+
 #ifdef BUILD_ITSELF
 void build_itself() __attribute__((constructor));
 void build_itself()
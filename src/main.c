@@ -1,5 +1,13 @@
 #define IMPLEMENT_BUILD_H
+#define HM_SWISS
 #include "../build.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef typeof((int*)NULL - (int*)NULL) ptrdiff_t;
 
@@ -9,21 +17,237 @@ typedef struct {
 
 typedef struct {
 	pair_t key;
-	int value;
+	long int value;
 } freq_t;
 
-int cmp(const void *a, const void *b, size_t size)
+typedef struct {
+	const char *data;
+	size_t size;
+} span_t;
+
+typedef struct {
+	span_t key;
+	size_t value;
+} word_t;
+
+// merged-away positions form runs of tombstones, the first and last slot of a
+// run hold its length so neighbours are found without walking the run
+#define TOKEN_SKIP 0x80000000u
+#define token_is_live(token) (!((token) & TOKEN_SKIP))
+#define POSITION_NONE SIZE_MAX
+
+// separates words in word-level training, pairs never span it
+#define TOKEN_BOUNDARY 0x7fffffffu
+
+// a narrow stream keeps tokens in 16 bits and spends one value, NARROW_SKIP, on
+// every tombstone, so all ids below it fit. A run up to NARROW_RUN_NEAR long is
+// measured by scanning for its end; a longer one has its length in the byte
+// array `runs` at its first and last slot, past NARROW_RUN_FAR the rest is
+// scanned again. A word boundary is a tombstone with its bit set in `boundaries`
+#define NARROW_SKIP 0xffffu
+#define NARROW_RUN_NEAR 16
+#define NARROW_RUN_FAR 0xffu
+#define narrow_boundary(bpe, i) ((bpe)->boundaries && ((bpe)->boundaries[(i) / 64] >> ((i) % 64) & 1))
+
+// for the loops that walk the stream: `narrow` is a constant at every call site,
+// so each gets a copy for either width instead of testing it per token
+#define WIDTH_SPECIALIZED static inline __attribute__((always_inline))
+
+#define PAIR_MAP_SEED 5186
+#define PAIR_MAP_MIN 1024
+
+static inline uint64_t pair_key(pair_t pair)
+{
+	return (uint64_t)pair.l << 32 | pair.r;
+}
+
+static inline uint64_t pair_seeded_key(pair_t pair)
+{
+	return pair_key(pair) ^ PAIR_MAP_SEED;
+}
+
+// murmur3 finalizer, a plain rotate leaves `r` out of the slot index
+static inline uint64_t pair_hash(pair_t pair)
+{
+	return hm_mix64(pair_seeded_key(pair));
+}
+
+static inline bool pair_eq(pair_t a, pair_t b)
+{
+	return pair_key(a) == pair_key(b);
+}
+
+typedef struct {
+	long int count;
+	size_t *positions;  // where the pair starts, NULL until it is first indexed
+} pair_stat_t;
+
+// pair -> count and positions, hashed (pair_hash, in vector lanes for a
+// batch) and compared inline so a probe is straight-line code; slots move when
+// the map grows or a pair is deleted, so only the last one returned is valid
+DEFINE_HASHMAP_MIX64(pair_map, pair_t, pair_stat_t, pair_seeded_key, pair_eq)
+
+// pair -> occurrences, for sampling
+DEFINE_COUNTING_HASHMAP(pair_count, pair_t, pair_hash, pair_eq)
+
+// free the map along with every position list it holds
+void pair_map_release(pair_map_t *map)
+{
+	for (size_t i = 0; i <= map->mask; ++i)
+	{
+		if (map->ctrl[i] && map->slots[i].value.positions) darray_free(map->slots[i].value.positions);
+	}
+	pair_map_free(map);
+}
+
+// the table threads count into together, the initial count as well as the
+// changes of a threaded merge
+#define COUNT_STRIPE_BITS 6
+#define COUNT_STRIPES (1 << COUNT_STRIPE_BITS)
+#define STRIPE_BUFFER 256
+
+DEFINE_STRIPED_HASHMAP(pair_stripes, pair_map, pair_t, pair_hash, COUNT_STRIPE_BITS)
+
+typedef struct {
+	pair_t pair;
+	size_t position;
+	long int delta;
+} pending_t;
+
+// add pending count changes to `map`, a positive one also indexes its
+// position; slots are looked up HM_BATCH at a time so the cache misses of
+// one block overlap
+void count_pending(pair_map_t *map, pending_t *pending, size_t count)
+{
+	pair_t keys[HM_BATCH];
+	pair_map_slot_t *slots[HM_BATCH];
+	for (size_t start = 0; start < count; start += HM_BATCH)
+	{
+		size_t block = count - start < HM_BATCH ? count - start : HM_BATCH;
+		for (size_t i = 0; i < block; ++i) keys[i] = pending[start + i].pair;
+		pair_map_insert_batch(map, keys, block, slots);
+
+		for (size_t i = 0; i < block; ++i)
+		{
+			pair_map_slot_t *slot = slots[i];
+			slot->value.count += pending[start + i].delta;
+			if (pending[start + i].delta <= 0) continue;
+
+			if (slot->value.positions == NULL) slot->value.positions = init_darray(slot->value.positions, 2, sizeof(size_t));
+			darray_push(slot->value.positions, pending[start + i].position);
+		}
+	}
+}
+
+// one thread's count changes on their way into a striped table, they wait in
+// a buffer per stripe so a lock is taken once per STRIPE_BUFFER of them
+typedef struct {
+	pair_stripes_t *table;
+	size_t filled[COUNT_STRIPES];
+	pending_t *pending;
+} stripe_buffer_t;
+
+void stripe_buffer_init(stripe_buffer_t *buffer, pair_stripes_t *table)
+{
+	*buffer = (stripe_buffer_t) {
+		.table = table,
+		.pending = malloc(COUNT_STRIPES * STRIPE_BUFFER * sizeof(pending_t))
+	};
+	if (buffer->pending == NULL) perror("failed to allocate pair buffer: "), exit(1);
+}
+
+// add the buffer of a stripe to it under a single lock
+void stripe_flush(stripe_buffer_t *buffer, size_t s)
+{
+	pair_map_t *map = pair_stripes_lock(buffer->table, s);
+	count_pending(map, buffer->pending + s * STRIPE_BUFFER, buffer->filled[s]);
+	pair_stripes_unlock(buffer->table, s);
+	buffer->filled[s] = 0;
+}
+
+void stripe_buffer_add(stripe_buffer_t *buffer, pair_t pair, size_t position, long int delta)
+{
+	size_t s = pair_stripes_stripe(pair);
+	buffer->pending[s * STRIPE_BUFFER + buffer->filled[s]++] = (pending_t) { .pair = pair, .position = position, .delta = delta };
+	if (buffer->filled[s] == STRIPE_BUFFER) stripe_flush(buffer, s);
+}
+
+// flush what is left and free the buffer
+void stripe_buffer_finish(stripe_buffer_t *buffer)
+{
+	for (size_t s = 0; s < COUNT_STRIPES; ++s)
+	{
+		if (buffer->filled[s]) stripe_flush(buffer, s);
+	}
+	free(buffer->pending);
+}
+
+typedef struct {
+	pair_map_t freqs;   // pair -> count and positions
+	freq_t *heap;       // lazy max-heap over `freqs`
+	pair_t *dead;       // pairs whose count dropped to zero, deleted once the merge pass is done
+	pair_t *pairs;      // token -> the pair it was merged from
+	void *tokens;       // token stream, edited in place by merges; uint16_t while `narrow`, uint32_t after
+	uint8_t *runs;      // lengths of the long runs of a narrow stream, NULL once wide
+	uint64_t *boundaries; // a bit per position of a narrow word-level stream, NULL otherwise
+	size_t *weights;    // occurrences of the word each position belongs to, NULL counts every position once
+	size_t token_count; // live tokens in `tokens`, boundaries excluded
+	stripe_buffer_t *deltas; // set on a thread's view of the state: count changes go here, not to `freqs`
+	bool narrow;        // every token id is still below NARROW_SKIP
+} bpe_t;
+
+// the token at `i` in the wide encoding; a narrow tombstone reads as a bare
+// TOKEN_SKIP, its run length is only known at the ends of the run
+WIDTH_SPECIALIZED uint32_t stream_get(bpe_t *bpe, size_t i, bool narrow)
+{
+	if (!narrow) return ((uint32_t*)bpe->tokens)[i];
+
+	uint16_t token = ((uint16_t*)bpe->tokens)[i];
+	if (token != NARROW_SKIP) return token;
+	return narrow_boundary(bpe, i) ? TOKEN_BOUNDARY : TOKEN_SKIP;
+}
+
+// what the stream holds at `i` undecoded, a token id only where a live token
+// is; the neighbours stream_next and stream_prev find are live or a boundary,
+// which reads as stream_boundary
+WIDTH_SPECIALIZED uint32_t stream_raw(bpe_t *bpe, size_t i, bool narrow)
+{
+	return narrow ? ((uint16_t*)bpe->tokens)[i] : ((uint32_t*)bpe->tokens)[i];
+}
+
+#define stream_boundary(narrow) ((narrow) ? NARROW_SKIP : TOKEN_BOUNDARY)
+
+static inline uint32_t token_get(bpe_t *bpe, size_t i)
+{
+	return bpe->narrow ? stream_get(bpe, i, true) : stream_get(bpe, i, false);
+}
+
+// a live token or boundary, on a stream that holds no runs
+static inline void token_set(bpe_t *bpe, size_t i, uint32_t token)
 {
-	uint64_t p = *(uint64_t*)a,
-					 q = *(uint64_t*)b;
+	if (!bpe->narrow) {
+		((uint32_t*)bpe->tokens)[i] = token;
+		return;
+	}
+
+	((uint16_t*)bpe->tokens)[i] = token == TOKEN_BOUNDARY ? NARROW_SKIP : token;
+	if (token == TOKEN_BOUNDARY) bpe->boundaries[i / 64] |= 1ull << (i % 64);
+}
 
-	return (p & q) != 0;
+uint64_t span_hash(const void *key, size_t len, uint32_t seed)
+{
+	(void)len;
+	const span_t *span = key;
+	return MURMUR3_64(span->data, span->size, seed);
 }
 
-uint64_t hash(const void *key, size_t len, uint32_t seed)
+int span_cmp(const void *a, const void *b, size_t size)
 {
-	uint64_t _key = *(uint64_t*)key;
-	return (_key >> seed) | (_key << (len - seed));
+	(void)size;
+	const span_t *p = a,
+							 *q = b;
+
+	return p->size == q->size && !memcmp(p->data, q->data, p->size);
 }
 
 int qsort_compare(const void *a, const void *b)
@@ -31,11 +255,71 @@ int qsort_compare(const void *a, const void *b)
 	return ((freq_t*)a)->value < ((freq_t*)b)->value;
 }
 
-void render_tokens(pair_t *pairs, uint32_t *tokens)
+// heap order matches the old linear max scan: highest count, then larger key by `memcmp`
+int freq_above(const freq_t *a, const freq_t *b)
+{
+	return a->value > b->value || (a->value == b->value && memcmp(&a->key, &b->key, sizeof(a->key)) > 0);
+}
+
+void heap_sift_down(freq_t *heap, size_t i)
+{
+	size_t len = darray_len(heap);
+	for (;;)
+	{
+		size_t l = 2 * i + 1, r = l + 1, top = i;
+		if (l < len && freq_above(&heap[l], &heap[top])) top = l;
+		if (r < len && freq_above(&heap[r], &heap[top])) top = r;
+		if (top == i) break;
+
+		SWAP(freq_t, heap[i], heap[top]);
+		i = top;
+	}
+}
+
+freq_t *heap_push(freq_t *heap, freq_t item)
+{
+	darray_push(heap, item);
+	for (size_t i = darray_len(heap) - 1; i > 0;)
+	{
+		size_t parent = (i - 1) / 2;
+		if (!freq_above(&heap[i], &heap[parent])) break;
+
+		SWAP(freq_t, heap[i], heap[parent]);
+		i = parent;
+	}
+	return heap;
+}
+
+void heap_pop(freq_t *heap)
+{
+	darray_t *meta = __darray_get_meta__(heap);
+	heap[0] = heap[--meta->index];
+	heap_sift_down(heap, 0);
+}
+
+// drop every stale snapshot by rebuilding the heap from the live counts
+freq_t *heap_rebuild(freq_t *heap, pair_map_t *freqs)
+{
+	darray_reset(heap);
+	for (size_t i = 0; i <= freqs->mask; ++i)
+	{
+		pair_map_slot_t *slot = &freqs->slots[i];
+		if (freqs->ctrl[i] && slot->value.count > 0) darray_push(heap, ((freq_t) { .key = slot->key, .value = slot->value.count }));
+	}
+	for (size_t i = darray_len(heap) / 2; i-- > 0;)
+	{
+		heap_sift_down(heap, i);
+	}
+	return heap;
+}
+
+void render_tokens(bpe_t *bpe)
 {
-	for (size_t i = 0; i < darray_len(tokens); ++i)
+	pair_t *pairs = bpe->pairs;
+	for (size_t i = 0; i < darray_len(bpe->tokens); ++i)
 	{
-		uint32_t token = tokens[i];
+		uint32_t token = token_get(bpe, i);
+		if (!token_is_live(token) || token == TOKEN_BOUNDARY) continue;
 		if (token > darray_len(pairs)) return;
 
 		if (pairs[token].l == token)
@@ -51,10 +335,74 @@ void log_bench_result(clock_t start, clock_t end, const char *name, size_t itera
 	double cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
 	double ops_per_sec = iteration / cpu_time_used;
 	double avg_time_per_op = cpu_time_used / iteration;
+	arena_scope();
 	INFO("%d %s in %f secs, %.2f ns/op, %.0f op/sec", iteration, name, cpu_time_used, avg_time_per_op * 1e9, ops_per_sec);
 }
 
-void report_progress(size_t iteration, uint32_t *tokens_in, pair_t *pairs, double *profile_samples, size_t profile_samples_count)
+#ifdef HM_STATS
+void report_probes(const char *label, size_t *probes)
+{
+	printf("INFO:   %s", label);
+	for (size_t i = 0; i < HM_PROBE_HIST; ++i)
+	{
+		if (probes[i]) printf(" %zu%s:%zu", i, i == HM_PROBE_HIST - 1 ? "+" : "", probes[i]);
+	}
+	printf("\n");
+}
+
+// probe histograms cover the interval since the last report, resizes the whole run
+void report_map(pair_map_t *freqs)
+{
+	hm_stats_t *stats = &freqs->stats;
+	printf("INFO:   Pair map:    %zu slots, load %.3lf, %zu resizes in %lfsecs\n",
+			freqs->mask + 1, (double)freqs->len / (double)(freqs->mask + 1), stats->resizes, stats->rehash_time);
+	report_probes("Get probes: ", stats->get_probes);
+	report_probes("Put probes: ", stats->put_probes);
+	memset(stats->get_probes, 0, sizeof(stats->get_probes));
+	memset(stats->put_probes, 0, sizeof(stats->put_probes));
+}
+#endif
+
+// bytes held by each part of the training state
+typedef struct {
+	size_t tokens;    // the stream, with the side arrays of a narrow one
+	size_t weights;
+	size_t pairs;
+	size_t freqs;     // slots and control bytes of the pair table
+	size_t positions; // position lists of every pair
+	size_t heap;
+	size_t dead;
+	size_t total;
+	size_t peak_rss;  // of the whole process
+} memory_usage_t;
+
+memory_usage_t bpe_memory(bpe_t *bpe)
+{
+	memory_usage_t usage = {
+		.tokens = (bpe->tokens ? darray_bytes(bpe->tokens) : 0)
+			+ (bpe->runs ? darray_bytes(bpe->runs) : 0)
+			+ (bpe->boundaries ? darray_bytes(bpe->boundaries) : 0),
+		.weights = bpe->weights ? darray_bytes(bpe->weights) : 0,
+		.pairs = bpe->pairs ? darray_bytes(bpe->pairs) : 0,
+		.freqs = bpe->freqs.slots ? pair_map_bytes(&bpe->freqs) : 0,
+		.heap = bpe->heap ? darray_bytes(bpe->heap) : 0,
+		.dead = bpe->dead ? darray_bytes(bpe->dead) : 0,
+	};
+	for (size_t i = 0; bpe->freqs.slots && i <= bpe->freqs.mask; ++i)
+	{
+		if (bpe->freqs.ctrl[i] && bpe->freqs.slots[i].value.positions)
+			usage.positions += darray_bytes(bpe->freqs.slots[i].value.positions);
+	}
+	usage.total = usage.tokens + usage.weights + usage.pairs + usage.freqs + usage.positions + usage.heap + usage.dead;
+
+	struct rusage rusage;
+	if (getrusage(RUSAGE_SELF, &rusage) == 0) usage.peak_rss = (size_t)rusage.ru_maxrss * 1024;
+	return usage;
+}
+
+#define MIB(bytes) ((double)(bytes) / (1024.0 * 1024.0))
+
+void report_progress(size_t iteration, bpe_t *bpe, double *profile_samples, size_t profile_samples_count)
 {
 	double average_profile_samples = 0.0f;
 	for (size_t i = 0; i < profile_samples_count; ++i) {
@@ -63,9 +411,18 @@ void report_progress(size_t iteration, uint32_t *tokens_in, pair_t *pairs, doubl
 	average_profile_samples /= profile_samples_count;
 
 	printf("INFO: -- ITERATION %zu --\n", iteration);
-	printf("INFO:   Token count: %zu\n", darray_len(tokens_in));
-	printf("INFO:   Pair count:  %zu\n", darray_len(pairs));
+	printf("INFO:   Token count: %zu\n", bpe->token_count);
+	printf("INFO:   Pair count:  %zu\n", darray_len(bpe->pairs));
 	printf("INFO:   Time:        %lfsecs (avg. of %zu iter.)\n", average_profile_samples, profile_samples_count);
+
+	memory_usage_t usage = bpe_memory(bpe);
+	printf("INFO:   Memory:      %.1lfMiB, peak RSS %.1lfMiB\n", MIB(usage.total), MIB(usage.peak_rss));
+	printf("INFO:     tokens %.1lfMiB, weights %.1lfMiB, pairs %.1lfMiB, freqs %.1lfMiB (%zu slots), positions %.1lfMiB, heap %.1lfMiB, dead %.1lfMiB\n",
+			MIB(usage.tokens), MIB(usage.weights), MIB(usage.pairs), MIB(usage.freqs), bpe->freqs.mask + 1,
+			MIB(usage.positions), MIB(usage.heap), MIB(usage.dead));
+#ifdef HM_STATS
+	report_map(&bpe->freqs);
+#endif
 }
 
 double get_time(void)
@@ -76,149 +433,1182 @@ double get_time(void)
 	return (double)tp.tv_sec + (double)tp.tv_nsec * 1e-9;
 }
 
-int main(void)
+int position_compare(const void *a, const void *b)
+{
+	size_t p = *(size_t*)a,
+				 q = *(size_t*)b;
+
+	return (p > q) - (p < q);
+}
+
+// length of the narrow run whose first slot is `first`, it ends at a live
+// token, a boundary or the end of the stream
+WIDTH_SPECIALIZED size_t narrow_run_forward(bpe_t *bpe, size_t first, size_t len)
 {
-	const char *text = read_file("skspear.txt");
-	const size_t text_size = strlen(text);
+	uint16_t *tokens = bpe->tokens;
+	for (size_t n = 1; n <= NARROW_RUN_NEAR; ++n)
+	{
+		if (first + n >= len || tokens[first + n] != NARROW_SKIP || narrow_boundary(bpe, first + n)) return n;
+	}
+	if (bpe->runs[first] < NARROW_RUN_FAR) return bpe->runs[first];
 
-	freq_t *freqs = NULL;
-	pair_t *pairs = NULL;
-	uint32_t *tokens_in = NULL;
-	uint32_t *tokens_out = NULL;
+	size_t end = first + NARROW_RUN_FAR;
+	while (end < len && tokens[end] == NARROW_SKIP && !narrow_boundary(bpe, end)) end++;
+	return end - first;
+}
 
-	freqs = init_hm(freqs, 2, sizeof(freq_t), hash, cmp, 5186);
-	pairs = init_darray(pairs, 4, sizeof(pair_t));
-	tokens_in = init_darray(tokens_in, 4, sizeof(uint32_t));
-	tokens_out = init_darray(tokens_out, 4, sizeof(uint32_t));
+// length of the narrow run whose last slot is `last`, it starts right after
+// the token it was merged into
+WIDTH_SPECIALIZED size_t narrow_run_back(bpe_t *bpe, size_t last)
+{
+	uint16_t *tokens = bpe->tokens;
+	for (size_t n = 1; n <= NARROW_RUN_NEAR; ++n)
+	{
+		if (tokens[last - n] != NARROW_SKIP) return n;
+	}
+	if (bpe->runs[last] < NARROW_RUN_FAR) return bpe->runs[last];
 
-	for (uint32_t i = 0; i < 256; ++i)
+	size_t start = last - NARROW_RUN_FAR;
+	while (tokens[start] == NARROW_SKIP) start--;
+	return last - start;
+}
+
+WIDTH_SPECIALIZED size_t stream_next(bpe_t *bpe, size_t position, bool narrow)
+{
+	size_t next = position + 1, len = darray_len(bpe->tokens);
+	if (next >= len) return POSITION_NONE;
+
+	if (!narrow) {
+		uint32_t token = ((uint32_t*)bpe->tokens)[next];
+		if (!token_is_live(token)) next += token & ~TOKEN_SKIP;
+	}
+	else if (((uint16_t*)bpe->tokens)[next] == NARROW_SKIP && !narrow_boundary(bpe, next)) {
+		next += narrow_run_forward(bpe, next, len);
+	}
+
+	return next < len ? next : POSITION_NONE;
+}
+
+WIDTH_SPECIALIZED size_t stream_prev(bpe_t *bpe, size_t position, bool narrow)
+{
+	if (position == 0) return POSITION_NONE;
+
+	// a run always follows the live token it was merged into
+	size_t prev = position - 1;
+	if (!narrow) {
+		uint32_t token = ((uint32_t*)bpe->tokens)[prev];
+		if (!token_is_live(token)) prev -= token & ~TOKEN_SKIP;
+	}
+	else if (((uint16_t*)bpe->tokens)[prev] == NARROW_SKIP && !narrow_boundary(bpe, prev)) {
+		prev -= narrow_run_back(bpe, prev);
+	}
+
+	return prev;
+}
+
+size_t token_next(bpe_t *bpe, size_t position)
+{
+	return bpe->narrow ? stream_next(bpe, position, true) : stream_next(bpe, position, false);
+}
+
+size_t token_prev(bpe_t *bpe, size_t position)
+{
+	return bpe->narrow ? stream_prev(bpe, position, true) : stream_prev(bpe, position, false);
+}
+
+#define position_weight(bpe, position) ((bpe)->weights ? (long int)(bpe)->weights[position] : 1)
+
+// change the count of `pair` by `delta`, returns its slot in `freqs`; a
+// positive change also indexes `position` as a start of the pair. A thread
+// sends the change on to `deltas` instead and gets no slot back
+pair_map_slot_t *pair_update(bpe_t *bpe, pair_t pair, size_t position, long int delta)
+{
+	if (bpe->deltas) {
+		stripe_buffer_add(bpe->deltas, pair, position, delta);
+		return NULL;
+	}
+
+	pair_map_slot_t *slot = pair_map_insert(&bpe->freqs, pair);
+	slot->value.count += delta;
+
+	if (delta > 0) {
+		if (slot->value.positions == NULL) slot->value.positions = init_darray(slot->value.positions, 2, sizeof(size_t));
+		darray_push(slot->value.positions, position);
+	}
+	return slot;
+}
+
+// add one occurrence of `pair` starting at `position`, returns its slot in `freqs`
+pair_map_slot_t *pair_add(bpe_t *bpe, pair_t pair, size_t position)
+{
+	return pair_update(bpe, pair, position, position_weight(bpe, position));
+}
+
+// remove one occurrence of `pair` starting at `position`, the stale position
+// is skipped when the pair is merged
+void pair_remove(bpe_t *bpe, pair_t pair, size_t position)
+{
+	// a thread's changes may add up to less than zero until they are reduced
+	if (bpe->deltas) {
+		pair_update(bpe, pair, position, -position_weight(bpe, position));
+		return;
+	}
+
+	pair_map_slot_t *slot = pair_map_find(&bpe->freqs, pair);
+	if (!(slot != NULL)) {
+		printf("%s:%d: pair = (%u, %u)\n", __FILE__, __LINE__, pair.l, pair.r);
+		exit(1);
+	}
+	if (!(slot->value.count > 0)) exit(1);
+	slot->value.count -= position_weight(bpe, position);
+	if (slot->value.count == 0) darray_push(bpe->dead, pair);
+}
+
+// drop stale snapshots until the top of the heap holds a live count, false once
+// the heap runs dry. Increments push a fresh snapshot, decrements are caught
+// here: a snapshot above the live count is requeued with the live count, one
+// below it is dropped
+bool heap_settle(bpe_t *bpe)
+{
+	while (darray_len(bpe->heap) > 0)
+	{
+		pair_map_slot_t *slot = pair_map_find(&bpe->freqs, bpe->heap[0].key);
+		freq_t live = { .key = bpe->heap[0].key, .value = slot ? slot->value.count : 0 };
+		if (live.value == bpe->heap[0].value) return true;
+
+		int requeue = live.value > 0 && live.value < bpe->heap[0].value;
+		heap_pop(bpe->heap);
+		if (requeue) bpe->heap = heap_push(bpe->heap, live);
+	}
+	return false;
+}
+
+// merge `max_pair` at `l` if it still starts there, the count changes go into `counts`
+WIDTH_SPECIALIZED bool merge_at(bpe_t *bpe, bpe_t *counts, pair_t max_pair, uint32_t max_token, size_t l, bool narrow)
+{
+	if (stream_raw(bpe, l, narrow) != max_pair.l) return false;
+
+	size_t r = stream_next(bpe, l, narrow);
+	if (r == POSITION_NONE || stream_raw(bpe, r, narrow) != max_pair.r) return false;
+
+	size_t prev = stream_prev(bpe, l, narrow);
+	size_t next = stream_next(bpe, r, narrow);
+	pair_map_slot_t *slot;
+
+	if (prev != POSITION_NONE && stream_raw(bpe, prev, narrow) != stream_boundary(narrow)) {
+		pair_t pair = { .l = stream_raw(bpe, prev, narrow), .r = max_pair.l };
+		pair_remove(counts, pair, prev);
+
+		pair.r = max_token;
+		slot = pair_add(counts, pair, prev);
+		if (!counts->deltas) bpe->heap = heap_push(bpe->heap, ((freq_t) { .key = slot->key, .value = slot->value.count }));
+	}
+
+	pair_remove(counts, max_pair, l);
+
+	if (next != POSITION_NONE && stream_raw(bpe, next, narrow) != stream_boundary(narrow)) {
+		pair_t pair = { .l = max_pair.r, .r = stream_raw(bpe, next, narrow) };
+		pair_remove(counts, pair, r);
+
+		pair.l = max_token;
+		slot = pair_add(counts, pair, l);
+		if (!counts->deltas) bpe->heap = heap_push(bpe->heap, ((freq_t) { .key = slot->key, .value = slot->value.count }));
+	}
+
+	// `r` and the runs on either side of it become a single run after `l`
+	uint32_t skip = (next != POSITION_NONE ? next : darray_len(bpe->tokens)) - l - 1;
+	if (!narrow) {
+		uint32_t *tokens = bpe->tokens;
+		tokens[l] = max_token;
+		tokens[r] = TOKEN_SKIP;
+		tokens[l + 1] = TOKEN_SKIP | skip;
+		tokens[l + skip] = TOKEN_SKIP | skip;
+	}
+	else {
+		// the ends of the new run are `r` or already tombstones
+		uint16_t *tokens = bpe->tokens;
+		tokens[l] = max_token;
+		tokens[r] = NARROW_SKIP;
+		if (skip > NARROW_RUN_NEAR) bpe->runs[l + 1] = bpe->runs[l + skip] = skip < NARROW_RUN_FAR ? skip : NARROW_RUN_FAR;
+	}
+
+	return true;
+}
+
+// a thread's view of the shared token stream, its count changes go to `deltas`
+void bpe_init_local(bpe_t *local, bpe_t *bpe, stripe_buffer_t *deltas)
+{
+	*local = (bpe_t) {
+		.tokens = bpe->tokens,
+		.runs = bpe->runs,
+		.boundaries = bpe->boundaries,
+		.narrow = bpe->narrow,
+		.weights = bpe->weights,
+		.deltas = deltas
+	};
+}
+
+// fold the counts and positions in `map`, one stripe of a table the threads
+// filled, into `bpe`; pairs that grew are requeued once the heap exists
+void bpe_reduce(bpe_t *bpe, pair_map_t *map)
+{
+	for (size_t i = 0; i <= map->mask; ++i)
 	{
-		darray_push(pairs, ((pair_t) { .l = i }));
+		pair_map_slot_t *from = &map->slots[i];
+		if (!map->ctrl[i]) continue;
+
+		pair_map_slot_t *slot = pair_map_insert(&bpe->freqs, from->key);
+		slot->value.count += from->value.count;
+		if (slot->value.positions == NULL) slot->value.positions = from->value.positions;
+		else if (from->value.positions) {
+			for (size_t j = 0; j < darray_len(from->value.positions); ++j)
+			{
+				darray_push(slot->value.positions, from->value.positions[j]);
+			}
+			darray_free(from->value.positions);
+		}
+		from->value.positions = NULL;
+
+		if (!(slot->value.count >= 0)) exit(1);
+		if (slot->value.count == 0 && bpe->dead) darray_push(bpe->dead, slot->key);
+		if (bpe->heap && from->value.count > 0)
+			bpe->heap = heap_push(bpe->heap, ((freq_t) { .key = slot->key, .value = slot->value.count }));
 	}
+}
 
-	for (size_t i = 0; i < text_size; ++i)
+// merges with fewer occurrences than this are not worth a thread
+#define MERGE_CHUNK_MIN (1 << 14)
+
+typedef struct {
+	bpe_t *bpe;
+	bpe_t counts;
+	stripe_buffer_t deltas;
+	pair_t *batch;
+	size_t batch_size;
+	uint32_t first_token;
+	size_t *positions;
+	size_t start, end;
+	size_t merged;
+	pthread_t thread;
+} merge_job_t;
+
+// the pair of the batch that starts with `token`, pairs in a batch share no
+// tokens so there is at most one
+long int batch_find(pair_t *batch, size_t batch_size, uint32_t token)
+{
+	for (size_t k = 0; k < batch_size; ++k)
 	{
-		darray_push(tokens_in, text[i]);
+		if (batch[k].l == token) return k;
 	}
+	return -1;
+}
 
-	double start, end;
+// merge the batch at every position in [start, end) that still holds one of
+// its pairs, returns how many did
+WIDTH_SPECIALIZED size_t merge_range(bpe_t *bpe, bpe_t *counts, pair_t *batch, size_t batch_size, uint32_t first_token, size_t *positions, size_t start, size_t end, bool narrow)
+{
+	size_t merged = 0;
+	for (size_t i = start; i < end; ++i)
+	{
+		size_t l = positions[i];
+		long int k = batch_find(batch, batch_size, stream_raw(bpe, l, narrow));
+		if (k < 0) continue;
+
+		merged += merge_at(bpe, counts, batch[k], first_token + k, l, narrow);
+	}
+	return merged;
+}
+
+size_t merge_positions(bpe_t *bpe, bpe_t *counts, pair_t *batch, size_t batch_size, uint32_t first_token, size_t *positions, size_t start, size_t end)
+{
+	if (bpe->narrow) return merge_range(bpe, counts, batch, batch_size, first_token, positions, start, end, true);
+	return merge_range(bpe, counts, batch, batch_size, first_token, positions, start, end, false);
+}
+
+void *merge_chunk(void *arg)
+{
+	merge_job_t *job = arg;
+	job->merged = merge_positions(job->bpe, &job->counts, job->batch, job->batch_size, job->first_token, job->positions, job->start, job->end);
+	stripe_buffer_finish(&job->deltas);
+	return NULL;
+}
+
+// drop the positions that no longer hold their pair, returns how many are left
+WIDTH_SPECIALIZED size_t keep_candidates(bpe_t *bpe, pair_t *batch, size_t batch_size, size_t *positions, size_t count, bool narrow)
+{
+	size_t candidates = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t l = positions[i];
+		long int k = batch_find(batch, batch_size, stream_raw(bpe, l, narrow));
+		if (k < 0) continue;
+
+		size_t r = stream_next(bpe, l, narrow);
+		if (r == POSITION_NONE || stream_raw(bpe, r, narrow) != batch[k].r) continue;
+
+		positions[candidates++] = l;
+	}
+	return candidates;
+}
+
+// a merge at `q` reads one live token on either side of its pair and writes up
+// to the token after it, a chunk starting at `p` must stay clear of all that
+bool chunk_can_start(bpe_t *bpe, size_t q, size_t p)
+{
+	size_t r = token_next(bpe, q);
+	size_t next = r != POSITION_NONE ? token_next(bpe, r) : POSITION_NONE;
+	return next == POSITION_NONE || p > next;
+}
+
+// pairs that no longer occur leave `freqs`, merged ones among them, so the
+// table tracks the live pairs only
+void bpe_merge_done(bpe_t *bpe, size_t batch_size, size_t *positions)
+{
+	if (batch_size > 1) darray_free(positions);
+
+	for (size_t i = 0; i < darray_len(bpe->dead); ++i)
+	{
+		// a pair may have come back, or be listed twice
+		pair_map_slot_t *slot = pair_map_find(&bpe->freqs, bpe->dead[i]);
+		if (!(slot && slot->value.count == 0)) continue;
+
+		if (slot->value.positions) darray_free(slot->value.positions);
+		pair_map_del(&bpe->freqs, slot);
+	}
+	darray_reset(bpe->dead);
+
+	if (bpe->freqs.mask + 1 > PAIR_MAP_MIN && 8 * bpe->freqs.len < bpe->freqs.mask + 1)
+		pair_map_resize(&bpe->freqs, (bpe->freqs.mask + 1) / 2);
+}
+
+// replace every occurrence of each pair in `batch` with `first_token` onwards,
+// visiting only the indexed positions; pairs in a batch share no tokens, so
+// their merges commute and a single pass over all their positions suffices
+void bpe_merge(bpe_t *bpe, pair_t *batch, size_t batch_size, uint32_t first_token, size_t thread_count)
+{
+	size_t *positions = NULL;
+	for (size_t k = 0; k < batch_size; ++k)
+	{
+		pair_map_slot_t *slot = pair_map_find(&bpe->freqs, batch[k]);
+		if (!(slot != NULL && slot->value.positions != NULL)) exit(1);
+
+		if (batch_size == 1) {
+			positions = slot->value.positions;
+			break;
+		}
+
+		if (positions == NULL) positions = init_darray(positions, darray_len(slot->value.positions) + 1, sizeof(size_t));
+		for (size_t i = 0; i < darray_len(slot->value.positions); ++i)
+		{
+			darray_push(positions, slot->value.positions[i]);
+		}
+	}
+
+	// left to right, so overlapping runs like `aaa` merge exactly as a full scan would
+	qsort(positions, darray_len(positions), sizeof(size_t), position_compare);
+
+	size_t count = darray_len(positions);
+	if (thread_count > count / MERGE_CHUNK_MIN) thread_count = count / MERGE_CHUNK_MIN;
 
+	if (thread_count <= 1) {
+		bpe->token_count -= merge_positions(bpe, bpe, batch, batch_size, first_token, positions, 0, count);
+		bpe_merge_done(bpe, batch_size, positions);
+		return;
+	}
+
+	// filtered before any thread writes to the stream
+	size_t candidates = bpe->narrow
+		? keep_candidates(bpe, batch, batch_size, positions, count, true)
+		: keep_candidates(bpe, batch, batch_size, positions, count, false);
+
+	// chunk boundaries never split an overlapping run, so every thread makes the
+	// same decisions as the serial pass would; they are all placed before the
+	// first thread starts writing to the stream they are read from
+	merge_job_t *jobs = calloc(thread_count, sizeof(merge_job_t));
+	pair_stripes_t deltas;
+	pair_stripes_init(&deltas, 0);
+	size_t *ends = malloc(thread_count * sizeof(size_t));
+	for (size_t t = 0, start = 0; t < thread_count; ++t)
+	{
+		size_t end = candidates * (t + 1) / thread_count;
+		if (end < start) end = start;
+		while (end > 0 && end < candidates && !chunk_can_start(bpe, positions[end - 1], positions[end])) end++;
+
+		ends[t] = start = end;
+	}
+
+	for (size_t t = 0, start = 0; t < thread_count; ++t)
+	{
+		size_t end = ends[t];
+		jobs[t] = (merge_job_t) {
+			.bpe = bpe,
+			.batch = batch,
+			.batch_size = batch_size,
+			.first_token = first_token,
+			.positions = positions,
+			.start = start,
+			.end = end
+		};
+		stripe_buffer_init(&jobs[t].deltas, &deltas);
+		bpe_init_local(&jobs[t].counts, bpe, &jobs[t].deltas);
+		if (pthread_create(&jobs[t].thread, NULL, merge_chunk, &jobs[t]) != 0)
+			perror("failed to create merging thread: "), exit(1);
+
+		start = end;
+	}
+
+	for (size_t t = 0; t < thread_count; ++t)
+	{
+		pthread_join(jobs[t].thread, NULL);
+		bpe->token_count -= jobs[t].merged;
+	}
+	free(ends);
+	free(jobs);
+
+	// the changes of every thread to a pair meet in one slot, so each pair is
+	// folded in once rather than once per thread
+	for (size_t s = 0; s < COUNT_STRIPES; ++s)
+	{
+		bpe_reduce(bpe, &deltas.stripes[s].map);
+	}
+	pair_stripes_free(&deltas);
+
+	bpe_merge_done(bpe, batch_size, positions);
+}
+
+// pairs share no tokens with the batch so far
+bool batch_conflicts(freq_t *batch, size_t batch_size, pair_t pair)
+{
+	for (size_t k = 0; k < batch_size; ++k)
+	{
+		pair_t other = batch[k].key;
+		if (pair.l == other.l || pair.l == other.r || pair.r == other.l || pair.r == other.r) return true;
+	}
+	return false;
+}
+
+// pick up to `batch_max` pairs sharing no tokens to merge in one pass, most
+// frequent first; returns 0 once no pair occurs more than once.
+//
+// Without `exact` conflicting pairs are skipped and the batch is filled from
+// further down the heap, which may pick pairs a serial run would not. With it,
+// a conflict ends the batch and the batch is cut back to its last pair that is
+// strictly more frequent than the best pair left out. Merging (a, b) only
+// creates pairs at most as frequent as some (x, a) or (b, y) it removes, none
+// of which is in the batch, so the serial run picks the same pairs in the same
+// order. A pair like (a, a) breaks that bound, `aaaa` turns into (A, A), so it
+// ends the batch as well.
+size_t select_batch(bpe_t *bpe, freq_t *batch, size_t batch_max, bool exact)
+{
+	freq_t *skipped = NULL;
+	skipped = init_darray(skipped, 4, sizeof(freq_t));
+
+	size_t batch_size = 0;
+	long int rest = 0;
+	while (heap_settle(bpe))
+	{
+		freq_t top = bpe->heap[0];
+		bool closed = exact && batch_size > 0 && (batch_conflicts(batch, batch_size, top.key) || batch[batch_size - 1].key.l == batch[batch_size - 1].key.r);
+		if (top.value <= 1 || batch_size == batch_max || closed) {
+			rest = top.value;
+			break;
+		}
+
+		heap_pop(bpe->heap);
+		if (batch_conflicts(batch, batch_size, top.key)) {
+			darray_push(skipped, top);
+		}
+		else batch[batch_size++] = top;
+	}
+
+	while (exact && batch_size > 1 && !(batch[batch_size - 1].value > rest))
+	{
+		rest = batch[--batch_size].value;
+		darray_push(skipped, batch[batch_size]);
+	}
+
+	for (size_t i = 0; i < darray_len(skipped); ++i)
+	{
+		bpe->heap = heap_push(bpe->heap, skipped[i]);
+	}
+	darray_free(skipped);
+
+	return batch_size;
+}
+
+// zero extend `n` bytes into narrow tokens, 16 at a time where SSE2 is there
+void widen_bytes(uint16_t *out, const uint8_t *in, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(in + i));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi8(bytes, zero));
+		_mm_storeu_si128((__m128i*)(out + i + 8), _mm_unpackhi_epi8(bytes, zero));
+	}
+#endif
+	for (; i < n; ++i) out[i] = in[i];
+}
+
+// move the stream to 32-bit tokens, for good
+void bpe_widen(bpe_t *bpe)
+{
+	size_t len = darray_len(bpe->tokens);
+	uint32_t *wide = init_darray_mapped(NULL, len + 1, sizeof(uint32_t));
+	uint32_t *out = darray_push_n(wide, len);
+
+	// a live token or boundary, then the run up to the next one
+	for (size_t i = 0; i < len;)
+	{
+		size_t next = stream_next(bpe, i, true);
+		size_t end = next != POSITION_NONE ? next : len;
+		uint32_t skip = end - i - 1;
+
+		out[i] = stream_get(bpe, i, true);
+		for (size_t j = i + 1; j < end; ++j) out[j] = TOKEN_SKIP;
+		if (skip) out[i + 1] = out[end - 1] = TOKEN_SKIP | skip;
+		i = end;
+	}
+
+	darray_free(bpe->tokens);
+	darray_free(bpe->runs);
+	if (bpe->boundaries) darray_free(bpe->boundaries);
+	bpe->tokens = wide;
+	bpe->runs = NULL;
+	bpe->boundaries = NULL;
+	bpe->narrow = false;
+	printf("INFO: token stream widened to 32 bits at token %zu\n", darray_len(bpe->pairs));
+}
+
+// one token per input byte, the stream starts out narrow
+void bpe_load_bytes(bpe_t *bpe, const char *text, size_t text_size)
+{
+	uint16_t *tokens = bpe->tokens;
+	widen_bytes(darray_push_n(tokens, text_size), (const uint8_t*)text, text_size);
+	(void)darray_push_n(bpe->runs, text_size);
+	bpe->tokens = tokens;
+	bpe->token_count = darray_len(bpe->tokens);
+}
+
+enum { CHAR_WORD, CHAR_SPACE, CHAR_PUNCT };
+
+int char_class(unsigned char c)
+{
+	if (isalnum(c) || c >= 0x80) return CHAR_WORD;
+	if (isspace(c)) return CHAR_SPACE;
+	return CHAR_PUNCT;
+}
+
+// a word is a run of one character class, a single space in front of a
+// word or punctuation run belongs to it
+size_t word_end(const char *text, size_t text_size, size_t start)
+{
+	size_t i = start;
+	if (text[i] == ' ' && i + 1 < text_size && char_class(text[i + 1]) != CHAR_SPACE) i++;
+
+	int class = char_class(text[i++]);
+	for (; i < text_size && char_class(text[i]) == class; ++i)
+	{
+		if (class == CHAR_SPACE && text[i] == ' ' && i + 1 < text_size && char_class(text[i + 1]) != CHAR_SPACE) break;
+	}
+	return i;
+}
+
+// one copy of every distinct word, weighted by how often it occurs and
+// separated by TOKEN_BOUNDARY so no merge crosses a word
+void bpe_load_words(bpe_t *bpe, const char *text, size_t text_size)
+{
+	word_t *words = NULL;
+	words = init_hm(words, 1024, sizeof(word_t), span_hash, span_cmp, 5186);
+
+	size_t word_count = 0;
+	for (size_t start = 0, end; start < text_size; start = end, word_count++)
+	{
+		end = word_end(text, text_size, start);
+
+		span_t span = { .data = text + start, .size = end - start };
+		long int place = hm_geti(words, ((word_t) { .key = span }));
+		if (place < 0) hm_put(words, ((word_t) { .key = span, .value = 1 }));
+		else words[place].value += 1;
+	}
+
+	uint16_t *tokens = bpe->tokens;
+	bpe->weights = init_darray_mapped(bpe->weights, 2 * text_size + 1, sizeof(size_t));
+	bpe->boundaries = init_darray_mapped(bpe->boundaries, (2 * text_size + 1) / 64 + 1, sizeof(uint64_t));
+	(void)darray_push_n(bpe->boundaries, (2 * text_size + 1) / 64 + 1);
+	for (size_t i = 0; i < hm_len(words); ++i)
+	{
+		size_t size = words[i].key.size;
+		widen_bytes(darray_push_n(tokens, size), (const uint8_t*)words[i].key.data, size);
+		(void)darray_push_n(bpe->runs, size + 1);
+
+		size_t *weights = darray_push_n(bpe->weights, size);
+		for (size_t j = 0; j < size; ++j) weights[j] = words[i].value;
+		bpe->token_count += size;
+
+		bpe->boundaries[darray_len(tokens) / 64] |= 1ull << (darray_len(tokens) % 64);
+		darray_push(tokens, NARROW_SKIP);
+		darray_push(bpe->weights, 0);
+	}
+	bpe->tokens = tokens;
+
+	printf("INFO: %zu words, %zu distinct\n", word_count, hm_len(words));
+	hm_free(words);
+}
+
+// chunks smaller than this are not worth a thread
+#define COUNT_CHUNK_MIN (1 << 16)
+
+typedef struct {
+	bpe_t *bpe;
+	pair_stripes_t *stripes;  // NULL counts straight into `bpe`
+	size_t start, end;
+	pthread_t thread;
+} count_job_t;
+
+// count and index the pairs starting in [start, end), the last one reaches into the next chunk
+WIDTH_SPECIALIZED void count_range(count_job_t *job, bool narrow)
+{
+	bpe_t *bpe = job->bpe;
+	size_t len = darray_len(bpe->tokens);
+
+	// without stripes one buffer of HM_BATCH pairs feeds `freqs` directly
+	stripe_buffer_t buffer;
+	pending_t pending[HM_BATCH];
+	size_t filled = 0;
+	if (job->stripes) stripe_buffer_init(&buffer, job->stripes);
+
+	for (size_t i = job->start; i < job->end && i + 1 < len; ++i)
+	{
+		pair_t pair = {
+			.l = stream_get(bpe, i, narrow),
+			.r = stream_get(bpe, i + 1, narrow)
+		};
+		if (pair.l == TOKEN_BOUNDARY || pair.r == TOKEN_BOUNDARY) continue;
+
+		if (job->stripes) {
+			stripe_buffer_add(&buffer, pair, i, position_weight(bpe, i));
+			continue;
+		}
+
+		pending[filled++] = (pending_t) { .pair = pair, .position = i, .delta = position_weight(bpe, i) };
+		if (filled == HM_BATCH) {
+			count_pending(&bpe->freqs, pending, filled);
+			filled = 0;
+		}
+	}
+
+	if (job->stripes) stripe_buffer_finish(&buffer);
+	else count_pending(&bpe->freqs, pending, filled);
+}
+
+void *count_chunk(void *arg)
+{
+	count_job_t *job = arg;
+	if (job->bpe->narrow) count_range(job, true);
+	else count_range(job, false);
+	return NULL;
+}
+
+// blocks of the stream sampled to size the pair table before counting
+#define SAMPLE_BLOCKS 64
+#define SAMPLE_BLOCK_SIZE 4096
+
+// distinct pairs in the stream, estimated from evenly spaced blocks as the
+// pairs seen plus Chao1's guess at the unseen ones, which comes from how
+// many were seen exactly once and twice
+size_t estimate_pair_count(bpe_t *bpe)
+{
+	size_t len = darray_len(bpe->tokens);
+	size_t stride = len / SAMPLE_BLOCKS;
+	if (stride < SAMPLE_BLOCK_SIZE) stride = SAMPLE_BLOCK_SIZE;
+
+	pair_t *sample = malloc(SAMPLE_BLOCK_SIZE * sizeof(pair_t));
+	if (sample == NULL) perror("failed to allocate sample: "), exit(1);
+
+	pair_count_t seen;
+	pair_count_init(&seen, PAIR_MAP_MIN);
+	for (size_t start = 0; start < len; start += stride)
+	{
+		size_t block = 0;
+		for (size_t i = start; i < start + SAMPLE_BLOCK_SIZE && i + 1 < len; ++i)
+		{
+			pair_t pair = { .l = token_get(bpe, i), .r = token_get(bpe, i + 1) };
+			if (pair.l == TOKEN_BOUNDARY || pair.r == TOKEN_BOUNDARY) continue;
+
+			sample[block++] = pair;
+		}
+		pair_count_inc_batch(&seen, sample, block, 1);
+	}
+
+	double once = 0, twice = 0;
+	for (size_t i = 0; i <= seen.mask; ++i)
+	{
+		if (!seen.ctrl[i]) continue;
+		once += seen.slots[i].value == 1;
+		twice += seen.slots[i].value == 2;
+	}
+
+	double estimate = seen.len;
+	if (stride > SAMPLE_BLOCK_SIZE) estimate += twice > 0 ? once * once / (2 * twice) : once * (once - 1) / 2;
+
+	// no more pairs than positions, nor than the vocabulary allows
+	double vocab = darray_len(bpe->pairs);
+	if (estimate > vocab * vocab) estimate = vocab * vocab;
+	if (estimate > len) estimate = len;
+
+	pair_count_free(&seen);
+	free(sample);
+	return estimate;
+}
+
+// count and index every pair once, the merge pass keeps both up to date from here on
+void bpe_count(bpe_t *bpe, size_t thread_count)
+{
+	size_t len = darray_len(bpe->tokens);
+	if (thread_count > len / COUNT_CHUNK_MIN) thread_count = len / COUNT_CHUNK_MIN;
+	if (thread_count < 1) thread_count = 1;
+
+	size_t estimate = estimate_pair_count(bpe);
+
+	if (thread_count == 1) {
+		pair_map_reserve(&bpe->freqs, estimate);
+		count_job_t job = { .bpe = bpe, .start = 0, .end = len };
+		count_chunk(&job);
+		return;
+	}
+
+	// all threads count into one striped table, every pair lives in exactly one
+	// stripe, so no thread keeps a copy of the table; position lists come out
+	// unordered, the merge pass sorts them anyway
+	pair_stripes_t *stripes = malloc(sizeof(pair_stripes_t));
+	if (stripes == NULL) perror("failed to allocate pair stripes: "), exit(1);
+	pair_stripes_init(stripes, estimate);
+
+	count_job_t *jobs = calloc(thread_count, sizeof(count_job_t));
+	for (size_t t = 0; t < thread_count; ++t)
+	{
+		jobs[t] = (count_job_t) { .bpe = bpe, .stripes = stripes, .start = len * t / thread_count, .end = len * (t + 1) / thread_count };
+		if (pthread_create(&jobs[t].thread, NULL, count_chunk, &jobs[t]) != 0)
+			perror("failed to create counting thread: "), exit(1);
+	}
+	for (size_t t = 0; t < thread_count; ++t)
+	{
+		pthread_join(jobs[t].thread, NULL);
+	}
+
+	// hand the stripes over to `freqs`, the position lists move as they are;
+	// `freqs` is sized only here, from what the stripes actually hold
+	pair_map_reserve(&bpe->freqs, pair_stripes_len(stripes));
+	for (size_t s = 0; s < COUNT_STRIPES; ++s)
+	{
+		bpe_reduce(bpe, &stripes->stripes[s].map);
+	}
+
+	pair_stripes_free(stripes);
+	free(stripes);
+	free(jobs);
+}
+
+typedef struct {
+	uint64_t key;       // `l` in the high half, `r` in the low half
+	size_t position;
+} pair_record_t;
+
+// least significant digit first, so records with equal keys keep their
+// stream order and every position list comes out sorted
+void radix_sort(pair_record_t *records, size_t count)
+{
+	size_t histogram[8][256] = { 0 };
+	for (size_t i = 0; i < count; ++i)
+	{
+		for (int d = 0; d < 8; ++d) histogram[d][(records[i].key >> (8 * d)) & 0xff]++;
+	}
+
+	pair_record_t *from = records, *to = malloc(count * sizeof(pair_record_t));
+	pair_record_t *spare = to;
+	for (int d = 0; d < 8; ++d)
+	{
+		// a digit every key shares does not reorder anything
+		if (histogram[d][(records[0].key >> (8 * d)) & 0xff] == count) continue;
+
+		size_t offset[256];
+		for (size_t b = 0, sum = 0; b < 256; sum += histogram[d][b++]) offset[b] = sum;
+		for (size_t i = 0; i < count; ++i)
+		{
+			to[offset[(from[i].key >> (8 * d)) & 0xff]++] = from[i];
+		}
+		SWAP(pair_record_t*, from, to);
+	}
+
+	if (from != records) memcpy(records, from, count * sizeof(pair_record_t));
+	free(spare);
+}
+
+// a record for every pair in the stream, returns how many
+WIDTH_SPECIALIZED size_t pair_records(bpe_t *bpe, pair_record_t *records, bool narrow)
+{
+	size_t len = darray_len(bpe->tokens), count = 0;
+	for (size_t i = 0; i + 1 < len; ++i)
+	{
+		uint32_t l = stream_get(bpe, i, narrow), r = stream_get(bpe, i + 1, narrow);
+		if (l == TOKEN_BOUNDARY || r == TOKEN_BOUNDARY) continue;
+
+		records[count++] = (pair_record_t) { .key = (uint64_t)l << 32 | r, .position = i };
+	}
+	return count;
+}
+
+// count and index every pair by sorting (pair, position) records, no hashing
+// until each distinct pair goes into `freqs` once
+void bpe_count_radix(bpe_t *bpe)
+{
+	size_t len = darray_len(bpe->tokens);
+	pair_record_t *records = malloc((len ? len : 1) * sizeof(pair_record_t));
+
+	size_t count = bpe->narrow ? pair_records(bpe, records, true) : pair_records(bpe, records, false);
+	if (count > 0) radix_sort(records, count);
+
+	size_t distinct = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		distinct += i == 0 || records[i].key != records[i - 1].key;
+	}
+	pair_map_reserve(&bpe->freqs, distinct);
+
+	for (size_t start = 0, end; start < count; start = end)
+	{
+		long int value = 0;
+		for (end = start; end < count && records[end].key == records[start].key; ++end)
+		{
+			value += position_weight(bpe, records[end].position);
+		}
+
+		size_t *positions = NULL;
+		positions = init_darray(positions, 2, sizeof(size_t));
+		darray_reserve(positions, end - start);
+		for (size_t i = start; i < end; ++i)
+		{
+			darray_push(positions, records[i].position);
+		}
+
+		pair_t pair = { .l = records[start].key >> 32, .r = (uint32_t)records[start].key };
+		pair_map_slot_t *slot = pair_map_insert(&bpe->freqs, pair);
+		slot->value.count = value;
+		slot->value.positions = positions;
+	}
+
+	free(records);
+}
+
+// everything needed to pick training back up, the counts, index and heap
+// are rebuilt from the stream by one counting pass
+typedef struct {
+	char magic[8];
+	uint64_t iteration;
+	uint64_t pair_count;
+	uint64_t token_count;		// stream entries, boundaries included
+	uint64_t weighted;			// a weight follows every stream entry
+} checkpoint_t;
+
+#define CHECKPOINT_MAGIC "bpeckpt1"
+// each checkpoint rewrites the whole stream, so they are much rarer than progress reports
+#define CHECKPOINT_EVERY 250
+#define CHECKPOINT_BUFFER (1 << 16)
+
+void write_or_die(FILE *file, const void *data, size_t size, const char *path)
+{
+	if (size && fwrite(data, size, 1, file) != 1)
+		perror(formate_string("failed to write `%s`", path)), exit(1);
+}
+
+// the stream is written without its tombstones, through a temporary file so
+// a crash while saving leaves the previous checkpoint in place
+void bpe_save(bpe_t *bpe, size_t iteration, const char *path)
+{
+	arena_scope();
+	const char *temp = formate_string("%s.tmp", path);
+	FILE *file = fopen(temp, "wb");
+	if (file == NULL) perror(formate_string("failed to open `%s`", temp)), exit(1);
+
+	size_t len = darray_len(bpe->tokens);
+	checkpoint_t header = {
+		.magic = CHECKPOINT_MAGIC,
+		.iteration = iteration,
+		.pair_count = darray_len(bpe->pairs),
+		.weighted = bpe->weights != NULL
+	};
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (token_is_live(token_get(bpe, i))) header.token_count++;
+	}
+
+	write_or_die(file, &header, sizeof(header), temp);
+	write_or_die(file, bpe->pairs, header.pair_count * sizeof(pair_t), temp);
+
+	uint32_t *tokens = malloc(CHECKPOINT_BUFFER * sizeof(uint32_t));
+	size_t *weights = malloc(CHECKPOINT_BUFFER * sizeof(size_t));
+	size_t filled = 0;
+	for (int pass = 0; pass < 1 + (int)header.weighted; ++pass)
+	{
+		for (size_t i = 0; i <= len; ++i)
+		{
+			if (filled == CHECKPOINT_BUFFER || (i == len && filled)) {
+				if (pass == 0) write_or_die(file, tokens, filled * sizeof(uint32_t), temp);
+				else write_or_die(file, weights, filled * sizeof(size_t), temp);
+				filled = 0;
+			}
+			if (i == len || !token_is_live(token_get(bpe, i))) continue;
+
+			if (pass == 0) tokens[filled++] = token_get(bpe, i);
+			else weights[filled++] = bpe->weights[i];
+		}
+	}
+	free(weights);
+	free(tokens);
+
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0)
+		perror(formate_string("failed to write `%s`", temp)), exit(1);
+	if (rename(temp, path) != 0)
+		perror(formate_string("failed to rename `%s`", temp)), exit(1);
+}
+
+// a growable copy of count items
+void *darray_from(const void *data, size_t count, size_t item_size)
+{
+	void *array = init_darray(NULL, 4, item_size);
+	darray_extend(array, data, count);
+	return array;
+}
+
+// map a checkpoint back in, returns the iteration it was taken at
+size_t bpe_resume(bpe_t *bpe, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) perror(formate_string("failed to open `%s`", path)), exit(1);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) perror(formate_string("failed to stat `%s`", path)), exit(1);
+	size_t size = st.st_size;
+
+	const checkpoint_t *header = NULL;
+	if (size >= sizeof(checkpoint_t)) {
+		header = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (header == MAP_FAILED) perror(formate_string("failed to map `%s`", path)), exit(1);
+	}
+	close(fd);
+
+	size_t entry_size = sizeof(uint32_t) + (header && header->weighted ? sizeof(size_t) : 0);
+	if (header == NULL
+		|| memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+		|| header->pair_count < 256
+		|| header->pair_count > (size - sizeof(checkpoint_t)) / sizeof(pair_t)
+		|| header->token_count != (size - sizeof(checkpoint_t) - header->pair_count * sizeof(pair_t)) / entry_size
+		|| (size - sizeof(checkpoint_t) - header->pair_count * sizeof(pair_t)) % entry_size != 0) {
+		fprintf(stderr, "ERROR: `%s` is not a checkpoint\n", path);
+		exit(1);
+	}
+
+	const pair_t *pairs = (const pair_t*)(header + 1);
+	const uint32_t *tokens = (const uint32_t*)(pairs + header->pair_count);
+
+	// token ids index `pairs` everywhere from here on, so none is trusted
+	// before it is checked: a byte stands for itself, a merge refers back
+	// to earlier tokens only, and the stream holds known ids, plus boundaries
+	// if it is word-level
+	for (size_t i = 0; i < header->pair_count; ++i)
+	{
+		bool valid = i < 256 ? pairs[i].l == i && pairs[i].r == 0 : pairs[i].l < i && pairs[i].r < i;
+		if (!valid || i >= TOKEN_BOUNDARY) {
+			fprintf(stderr, "ERROR: `%s` holds an invalid merge for token %zu\n", path, i);
+			exit(1);
+		}
+	}
+	for (size_t i = 0; i < header->token_count; ++i)
+	{
+		if (tokens[i] >= header->pair_count && (tokens[i] != TOKEN_BOUNDARY || !header->weighted)) {
+			fprintf(stderr, "ERROR: `%s` holds an unknown token %u at %zu\n", path, tokens[i], i);
+			exit(1);
+		}
+	}
+
+	darray_free(bpe->pairs);
+	bpe->pairs = darray_from(pairs, header->pair_count, sizeof(pair_t));
+	// a compacted stream holds no runs, it is narrow if its tokens are
+	bpe->narrow = header->pair_count <= NARROW_SKIP;
+	if (bpe->narrow) {
+		uint16_t *narrow = init_darray_mapped(bpe->tokens, header->token_count + 1, sizeof(uint16_t));
+		(void)darray_push_n(narrow, header->token_count);
+		bpe->tokens = narrow;
+		bpe->runs = init_darray_mapped(bpe->runs, header->token_count + 1, sizeof(uint8_t));
+		(void)darray_push_n(bpe->runs, header->token_count);
+		if (header->weighted) {
+			bpe->boundaries = init_darray_mapped(bpe->boundaries, header->token_count / 64 + 1, sizeof(uint64_t));
+			(void)darray_push_n(bpe->boundaries, header->token_count / 64 + 1);
+		}
+		for (size_t i = 0; i < header->token_count; ++i) token_set(bpe, i, tokens[i]);
+	}
+	else {
+		uint32_t *wide = init_darray_mapped(bpe->tokens, header->token_count + 1, sizeof(uint32_t));
+		darray_extend(wide, tokens, header->token_count);
+		bpe->tokens = wide;
+	}
+	if (header->weighted) {
+		// the weights follow the tokens and may not be aligned for size_t
+		bpe->weights = init_darray_mapped(bpe->weights, header->token_count + 1, sizeof(size_t));
+		darray_extend(bpe->weights, tokens + header->token_count, header->token_count);
+	}
+
+	bpe->token_count = 0;
+	for (size_t i = 0; i < header->token_count; ++i)
+	{
+		if (tokens[i] != TOKEN_BOUNDARY) bpe->token_count++;
+	}
+
+	size_t iteration = header->iteration;
+	munmap((void*)header, size);
+
+	printf("INFO: resumed from `%s` at iteration %zu\n", path, iteration);
+	return iteration;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "skspear.txt";
+	bool word_level = false;
+	long int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	long int batch_max = 1;
+	bool exact = false;
+	const char *checkpoint = NULL;
+	long int checkpoint_every = CHECKPOINT_EVERY;
+	const char *resume = NULL;
+	bool radix = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--words")) word_level = true;
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc) thread_count = atol(argv[++i]);
+		else if (!strcmp(argv[i], "--batch") && i + 1 < argc) batch_max = atol(argv[++i]);
+		else if (!strcmp(argv[i], "--exact")) exact = true;
+		else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) checkpoint = argv[++i];
+		else if (!strcmp(argv[i], "--checkpoint-every") && i + 1 < argc) checkpoint_every = atol(argv[++i]);
+		else if (!strcmp(argv[i], "--resume") && i + 1 < argc) resume = argv[++i];
+		else if (!strcmp(argv[i], "--count") && i + 1 < argc && !strcmp(argv[i + 1], "radix")) radix = true, i++;
+		else if (!strcmp(argv[i], "--count") && i + 1 < argc && !strcmp(argv[i + 1], "hash")) radix = false, i++;
+		else if (argv[i][0] != '-') path = argv[i];
+		else {
+			fprintf(stderr, "usage: %s [--words] [--threads N] [--batch K [--exact]] [--count hash|radix] [--checkpoint F [--checkpoint-every N]] [--resume F] [file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (thread_count < 1) thread_count = 1;
+	if (batch_max < 1) batch_max = 1;
+	if (checkpoint_every < 1) checkpoint_every = 1;
+
+	bpe_t bpe = { 0 };
+
+	pair_map_init(&bpe.freqs, PAIR_MAP_MIN);
+	bpe.dead = init_darray(bpe.dead, 4, sizeof(pair_t));
+	bpe.pairs = init_darray(bpe.pairs, 4, sizeof(pair_t));
+
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		darray_push(bpe.pairs, ((pair_t) { .l = i }));
+	}
+
+	// the stream in a checkpoint already carries its mode
+	const char *text = NULL;
 	size_t iteration = 0;
+	if (resume) iteration = bpe_resume(&bpe, resume);
+	else {
+		text = read_file(path);
+		if (text == NULL) perror(formate_string("failed to read `%s`", path)), exit(1);
+		const size_t text_size = strlen(text);
+
+		// a mapped stream never copies while it is loaded; word-level adds at
+		// most one boundary per byte
+		bpe.tokens = init_darray_mapped(bpe.tokens, (word_level ? 2 : 1) * text_size + 1, sizeof(uint16_t));
+		bpe.runs = init_darray_mapped(bpe.runs, (word_level ? 2 : 1) * text_size + 1, sizeof(uint8_t));
+		bpe.narrow = true;
+		if (word_level) bpe_load_words(&bpe, text, text_size);
+		else bpe_load_bytes(&bpe, text, text_size);
+	}
+
+	double count_start = get_time();
+	if (radix) bpe_count_radix(&bpe);
+	else bpe_count(&bpe, thread_count);
+	printf("INFO: %zu distinct pairs counted in %lfsecs\n", bpe.freqs.len, get_time() - count_start);
+
+	bpe.heap = init_darray(bpe.heap, 4, sizeof(freq_t));
+	bpe.heap = heap_rebuild(bpe.heap, &bpe.freqs);
+
+	double start, end;
+
 	size_t total_iteration_dump = 10;
 	size_t max_iteration = 1000;
 
 	double *profile_samples = malloc(max_iteration * sizeof(double));
 	size_t profile_samples_count = 0;
 
-	for (; iteration < max_iteration; iteration++)
+	freq_t *batch = malloc(batch_max * sizeof(freq_t));
+	size_t last_dump = SIZE_MAX;
+	size_t last_checkpoint = iteration / checkpoint_every;
+
+	while (iteration < max_iteration)
 	{
 		start = get_time();
 
-		if (iteration % total_iteration_dump == 0) {
-			report_progress(iteration, tokens_in, pairs, profile_samples, total_iteration_dump);
+		// a batch may step over a multiple of either interval
+		if (iteration / total_iteration_dump != last_dump) {
+			last_dump = iteration / total_iteration_dump;
+			report_progress(iteration, &bpe, profile_samples, total_iteration_dump);
 		}
-
-		for (size_t i = 0; i < darray_len(tokens_in) - 1; ++i)
-		{
-			pair_t pair = {
-				.l = tokens_in[i],
-				.r = tokens_in[i + 1]
-			};
-			long int i = hm_geti(freqs, ((freq_t) { .key = pair }));
-			if (i < 0) {
-				hm_put(freqs, ((freq_t) { .key = pair, .value = 1 }));
-			}
-			else {
-				freqs[i].value++;
-			}
+		if (checkpoint && iteration / checkpoint_every != last_checkpoint) {
+			last_checkpoint = iteration / checkpoint_every;
+			bpe_save(&bpe, iteration, checkpoint);
 		}
 
-		long int max_index = 0;
-		for (long int i = 1; i < hm_len(freqs); ++i) {
-			if (freqs[i].value > freqs[max_index].value || (freqs[i].value == freqs[max_index].value && memcmp(&freqs[i].key, &freqs[max_index].key, sizeof(freqs[i].key)) > 0))
-				max_index = i;
+		if (darray_len(bpe.heap) > 2 * bpe.freqs.len) {
+			bpe.heap = heap_rebuild(bpe.heap, &bpe.freqs);
 		}
 
-		if (freqs[max_index].value <= 1) break;
+		size_t batch_size = (size_t)batch_max < max_iteration - iteration ? (size_t)batch_max : max_iteration - iteration;
+		batch_size = select_batch(&bpe, batch, batch_size, exact);
+		if (batch_size == 0) break;
 
-		pair_t max_pair = freqs[max_index].key;
-		uint32_t max_token = darray_len(pairs);
-		darray_push(pairs, max_pair);
-
-		darray_reset(tokens_out);
-		for (size_t i = 0; i < darray_len(tokens_in);) {
+		uint32_t first_token = darray_len(bpe.pairs);
+		// every new id has to stay below the narrow tombstone
+		if (bpe.narrow && first_token + batch_size > NARROW_SKIP) bpe_widen(&bpe);
+		for (size_t k = 0; k < batch_size; ++k)
+		{
+			darray_push(bpe.pairs, batch[k].key);
+		}
 
-			if (i + 1 >= darray_len(tokens_in)) {
-				darray_push(tokens_out, tokens_in[i]);
-				i += 1;
-				break;
-			}
+		bpe_merge(&bpe, bpe.pairs + first_token, batch_size, first_token, thread_count);
 
-			pair_t pair = {
-				.l = tokens_in[i],
-				.r = tokens_in[i + 1]
-			};
-
-			if (memcmp(&pair, &max_pair, sizeof(pair)) == 0) {
-				long int place;
-				if (darray_len(tokens_out) > 0) {
-					pair.l = tokens_out[darray_len(tokens_out) - 1];
-
-					pair.r = tokens_in[i];
-					place = hm_geti(freqs, ((freq_t) { .key = pair }));
-					if (!(place >= 0)) {
-						printf("%s:%d: i = %zu, pair = (%u, %u)\n", __FILE__, __LINE__, i, pair.l, pair.r);
-						exit(1);
-					}
-					if (!(freqs[place].value > 0)) exit(1);
-					freqs[place].value -= 1;
-
-					pair.r = max_token;
-					place = hm_geti(freqs, ((freq_t) { .key = pair }));
-					if (place < 0) hm_put(freqs, ( (freq_t) { .key = pair, .value = 1 } ));
-					else freqs[place].value += 1;
-				}
-
-				pair = max_pair;
-				place = hm_geti(freqs, ( (freq_t) { .key = pair } ));
-				if (!(place >= 0)) exit(1);
-				if (!(freqs[place].value > 0)) exit(1);
-				freqs[place].value -= 1;
-
-				darray_push(tokens_out, max_token);
-				i += 2;
-
-				if (i < darray_len(tokens_in)) {
-					pair.r = tokens_in[i];
-
-					pair.l = tokens_in[i - 1];
-					place = hm_geti(freqs, ( (freq_t) { .key = pair } ));
-					if (!(place >= 0)) exit(1);
-					if (!(freqs[place].value > 0)) exit(1);
-					freqs[place].value -= 1;
-
-					pair.l = tokens_out[darray_len(tokens_out) - 1];
-					place = hm_geti(freqs, ((freq_t) { .key = pair }));
-					if (place < 0) hm_put(freqs, ((freq_t) { .key = pair, .value = 1 }));
-					else freqs[place].value += 1;
-				}
-			} else {
-				darray_push(tokens_out, tokens_in[i]);
-				i += 1;
-			}
+		double elapsed = (get_time() - start) / batch_size;
+		for (size_t k = 0; k < batch_size; ++k, ++iteration)
+		{
+			profile_samples[iteration%total_iteration_dump] = elapsed;
 		}
-
-		SWAP(uint32_t *, tokens_in, tokens_out);
-		profile_samples[iteration%total_iteration_dump] = get_time() - start;
 	}
-	render_tokens(pairs, tokens_out);
+	render_tokens(&bpe);
 
 	// free
-	hm_free(freqs);
-	darray_free(pairs);
-	darray_free(tokens_in);
-	darray_free(tokens_out);
+	pair_map_release(&bpe.freqs);
+	darray_free(bpe.heap);
+	darray_free(bpe.dead);
+	darray_free(bpe.pairs);
+	darray_free(bpe.tokens);
+	if (bpe.runs) darray_free(bpe.runs);
+	if (bpe.boundaries) darray_free(bpe.boundaries);
+	if (bpe.weights) darray_free(bpe.weights);
+	free(batch);
+	free(profile_samples);
 	free((void*)text);
+	arena_free(&build_arena);
 
 	return 0;
 }
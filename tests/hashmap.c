@@ -0,0 +1,223 @@
+#define IMPLEMENT_BUILD_H
+#include "../build.h"
+
+// exercises the build.h hashmap in whatever layout the HM_* flags on the
+// command line select, `./build test` runs it for each of them
+
+#define expect(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while(0)
+
+#define KEYS 5000
+
+typedef struct {
+	uint64_t key;
+	uint64_t value;
+} kv_t;
+
+// few distinct hashes, so probe runs get long and deletes land inside them
+uint64_t clustered_hash(const void *bytes, size_t size, uint32_t seed)
+{
+	(void)size;
+	uint64_t key;
+	memcpy(&key, bytes, sizeof(key));
+	return (key % 61 + seed) * 0x9e3779b97f4a7c15ull;
+}
+
+static inline uint64_t key64(uint64_t key)
+{
+	return key;
+}
+
+static inline bool key_eq(uint64_t a, uint64_t b)
+{
+	return a == b;
+}
+
+DEFINE_HASHMAP_MIX64(typed_map, uint64_t, uint64_t, key64, key_eq)
+
+size_t bucket_count(kv_t *map)
+{
+	return ((hashmap_t*)__hashmap_get_meta__(map))->count;
+}
+
+// every key in `present` is found with its value, every other one is not
+void check(kv_t *map, const bool *present)
+{
+	size_t count = 0;
+	for (uint64_t k = 0; k < 2 * KEYS; ++k)
+	{
+		long int place = hm_geti(map, ((kv_t) { .key = k }));
+		if (k < KEYS && present[k]) {
+			expect(place >= 0);
+			expect(map[place].key == k && map[place].value == 3 * k);
+			count++;
+		}
+		else expect(place < 0);
+	}
+	expect(hm_len(map) == count);
+
+	// the dense array holds exactly the live entries
+	for (size_t i = 0; i < hm_len(map); ++i)
+	{
+		expect(map[i].key < KEYS && present[map[i].key]);
+	}
+}
+
+void test(hash_function_t hf)
+{
+	static bool present[KEYS];
+	memset(present, 0, sizeof(present));
+
+	kv_t *map = NULL;
+	map = init_hm(map, 8, sizeof(kv_t), hf, cmp_hash, 5186);
+
+	// grow through several rehashes, checked right after each one so that with
+	// HM_INCREMENTAL most entries are still in the old buckets
+	size_t buckets = bucket_count(map);
+	for (uint64_t k = 0; k < KEYS; ++k)
+	{
+		hm_put(map, ((kv_t) { .key = k, .value = 3 * k }));
+		present[k] = true;
+		if (bucket_count(map) != buckets) {
+			buckets = bucket_count(map);
+			check(map, present);
+		}
+	}
+
+	// overwriting changes the value in place and adds no entries
+	for (uint64_t k = 0; k < KEYS; ++k)
+	{
+		hm_put(map, ((kv_t) { .key = k, .value = k }));
+	}
+	for (uint64_t k = 0; k < KEYS; ++k)
+	{
+		long int place = hm_geti(map, ((kv_t) { .key = k }));
+		expect(place >= 0 && map[place].value == k);
+		map[place].value = 3 * k;
+	}
+	check(map, present);
+
+	kv_t kv = { .key = 42 };
+	hm_get(map, &kv);
+	expect(kv.value == 3 * 42);
+
+	// delete two thirds, missing keys are a no-op
+	for (uint64_t k = 0; k < 2 * KEYS; ++k)
+	{
+		if (k % 3 == 0) continue;
+		hm_del(map, ((kv_t) { .key = k }));
+		if (k < KEYS) present[k] = false;
+	}
+	check(map, present);
+
+	// insert back over the deleted buckets
+	for (uint64_t k = 1; k < KEYS; k += 3)
+	{
+		hm_put(map, ((kv_t) { .key = k, .value = 3 * k }));
+		present[k] = true;
+	}
+	check(map, present);
+
+	// churn until deleted buckets force hm_put to rebuild in place
+	for (int round = 0; round < 8; ++round)
+	{
+		for (uint64_t k = 1; k < KEYS; k += 3)
+		{
+			hm_del(map, ((kv_t) { .key = k }));
+			present[k] = false;
+		}
+		check(map, present);
+		for (uint64_t k = 1; k < KEYS; k += 3)
+		{
+			hm_put(map, ((kv_t) { .key = k, .value = 3 * k }));
+			present[k] = true;
+		}
+		check(map, present);
+	}
+
+	// compacting drops every deleted bucket and shrinks to the live entries
+	for (uint64_t k = 1; k < KEYS; k += 3)
+	{
+		hm_del(map, ((kv_t) { .key = k }));
+		present[k] = false;
+	}
+	hm_compact(map);
+	expect(hm_tombstone_ratio(map) == 0);
+	expect(hm_load(map) < LOAD_FACTOR);
+	check(map, present);
+
+	// empty it, compact, and fill it again
+	for (uint64_t k = 0; k < KEYS; ++k)
+	{
+		hm_del(map, ((kv_t) { .key = k }));
+		present[k] = false;
+	}
+	check(map, present);
+	hm_compact(map);
+	for (uint64_t k = 0; k < KEYS; k += 2)
+	{
+		hm_put(map, ((kv_t) { .key = k, .value = 3 * k }));
+		present[k] = true;
+	}
+	check(map, present);
+
+	hm_free(map);
+}
+
+// the vector lanes of hm_mix64_batch agree with hm_mix64, tails included
+void test_mix64(void)
+{
+	uint64_t values[37];
+	for (size_t n = 0; n <= 37; ++n)
+	{
+		for (size_t i = 0; i < n; ++i) values[i] = (i + 1) * 0x9e3779b97f4a7c15ull ^ (uint64_t)n << 58;
+		hm_mix64_batch(values, n);
+		for (size_t i = 0; i < n; ++i) expect(values[i] == hm_mix64((i + 1) * 0x9e3779b97f4a7c15ull ^ (uint64_t)n << 58));
+	}
+}
+
+// the _batch functions of a typed map agree with the one-key ones
+void test_typed(void)
+{
+	static uint64_t keys[KEYS];
+	static typed_map_slot_t *slots[KEYS];
+	for (uint64_t k = 0; k < KEYS; ++k) keys[k] = 7 * k;
+
+	typed_map_t map;
+	typed_map_init(&map, 0);
+	typed_map_insert_batch(&map, keys, KEYS, slots);
+	for (uint64_t k = 0; k < KEYS; ++k) slots[k]->value = 3 * k;
+	expect(map.len == KEYS);
+
+	for (uint64_t k = 0; k < KEYS; ++k)
+	{
+		uint64_t *value = typed_map_get(&map, 7 * k);
+		expect(value != NULL && *value == 3 * k);
+		if (k % 2 == 0) typed_map_del(&map, typed_map_find(&map, 7 * k));
+	}
+
+	typed_map_get_batch(&map, keys, KEYS, slots);
+	for (uint64_t k = 0; k < KEYS; ++k)
+	{
+		if (k % 2 == 0) expect(slots[k] == NULL);
+		else expect(slots[k] != NULL && slots[k]->key == 7 * k && slots[k]->value == 3 * k);
+	}
+	typed_map_free(&map);
+}
+
+int main(void)
+{
+	test_mix64();
+	test_typed();
+
+	test(fnv_1a_hash);
+	test(MURMUR3_64);
+	test(clustered_hash);
+
+	printf("hashmap: ok\n");
+	return 0;
+}